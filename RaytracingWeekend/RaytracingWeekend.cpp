@@ -1,8 +1,11 @@
 #include <iostream>
+#include <iomanip>
 #include <string>
 #include <chrono>
 
+#ifdef GUI_SUPPORT
 #include "preview_gui.h"
+#endif // GUI_SUPPORT
 
 #include "scene_generation.h"
 #include "sphere.h"
@@ -12,17 +15,133 @@
 #include "hittable_list.h"
 #include "camera.h"
 #include "material.h"
+#include "png_writer.h"
 
-std::string get_filename(int argc, char* argv[]) {
-    std::string cmd = "out";
-    for (int i = 1; i < argc; ++i)
+#ifdef EXR_SUPPORT
+#include "exr_writer.h"
+#endif // EXR_SUPPORT
+
+const char* usage = R"(usage: RaytracingWeekend [options] [output]
+  --scene <name>     one of builtin_scenes() in scene_generation.h (random)
+  --width <pixels>   horizontal resolution (720)
+  --height <pixels>  vertical resolution, 0 for the 16:9 aspect ratio (0)
+  --spp <samples>    samples per pixel (200)
+  --depth <bounces>  maximum path length (32)
+  --threads <count>  render threads, 0 for one per hardware thread (0)
+  --time-budget <s>  stop the render after this many seconds, 0 for no limit (0)
+  --target-error <e> stop once the pixels have a relative error below e, 0 for 2/sqrt(spp) (0)
+  --error-percentile <p>  fraction of the pixels that has to reach the target error, in (0, 1] (0.95)
+  --png <path>       PNG file to write (<output>.png)
+  --exr <path>       EXR file to write with EXR_SUPPORT (<output>.exr)
+  --headless         render once without the preview window and write the image, the default without GUI_SUPPORT
+output is the file name without extension (out)
+)";
+
+struct render_options {
+    std::string scene = "random";
+    std::string filename = "out";
+    std::string png_path, exr_path; // <filename>.png and .exr unless given
+    int width = 720;
+    int height = 0;
+    int samples = 200;
+    int max_depth = 32;
+    int threads = 0;
+    render_limits limits;
+#ifdef GUI_SUPPORT
+    bool headless = false;
+#else
+    bool headless = true;
+#endif
+};
+
+bool parse_options(int argc, char* argv[], render_options& options) {
+    int i = 1;
+    try
+    {
+        for (; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const bool has_value = i + 1 < argc;
+            if (arg == "--headless")
+                options.headless = true;
+            else if (arg == "--scene" && has_value)
+                options.scene = argv[++i];
+            else if (arg == "--width" && has_value)
+                options.width = std::stoi(argv[++i]);
+            else if (arg == "--height" && has_value)
+                options.height = std::stoi(argv[++i]);
+            else if (arg == "--spp" && has_value)
+                options.samples = std::stoi(argv[++i]);
+            else if (arg == "--depth" && has_value)
+                options.max_depth = std::stoi(argv[++i]);
+            else if (arg == "--threads" && has_value)
+                options.threads = std::stoi(argv[++i]);
+            else if (arg == "--time-budget" && has_value)
+                options.limits.time_budget = std::stod(argv[++i]);
+            else if (arg == "--target-error" && has_value)
+                options.limits.target_error = std::stod(argv[++i]);
+            else if (arg == "--error-percentile" && has_value)
+                options.limits.error_percentile = std::stod(argv[++i]);
+            else if (arg == "--png" && has_value)
+                options.png_path = argv[++i];
+            else if (arg == "--exr" && has_value)
+                options.exr_path = argv[++i];
+            else if (arg.starts_with("--"))
+            {
+                std::cerr << "Unknown option " << arg << "\n" << usage;
+                return false;
+            }
+            else
+                options.filename = arg;
+        }
+    }
+    catch (const std::exception&)
+    {
+        // std::stoi and std::stod throw for values that aren't numbers or don't fit into the type
+        std::cerr << "Invalid value " << argv[i] << " for " << argv[i - 1] << "\n" << usage;
+        return false;
+    }
+    if (options.width <= 0 || options.height < 0 || options.samples <= 0 || options.max_depth <= 0 || options.threads < 0)
+    {
+        std::cerr << "The resolution, samples and depth must be positive\n" << usage;
+        return false;
+    }
+    if (!(options.limits.time_budget >= 0 && options.limits.target_error >= 0 && options.limits.error_percentile > 0 && options.limits.error_percentile <= 1))
     {
-        cmd = argv[i];
+        std::cerr << "The time budget and target error can't be negative, the error percentile must be in (0, 1]\n" << usage;
+        return false;
     }
+    if (options.png_path.empty())
+        options.png_path = options.filename + ".png";
+    if (options.exr_path.empty())
+        options.exr_path = options.filename + ".exr";
+    if (!find_scene(options.scene))
+    {
+        std::cerr << "Unknown scene " << options.scene << ", available:";
+        for (const auto& scene : builtin_scenes())
+            std::cerr << " " << scene.name;
+        std::cerr << "\n";
+        return false;
+    }
+    return true;
+}
 
-    return cmd;
+using phase_clock = std::chrono::steady_clock;
+
+static double seconds_since(phase_clock::time_point start) {
+    return std::chrono::duration<double>(phase_clock::now() - start).count();
 }
 
+// Renders the frame once, without a window
+void render_headless(threaded_renderer& renderer, const hittable& world, const camera& cam, const light_list* lights) {
+    renderer.render(world, cam, lights);
+    while (!renderer.finished())
+    {
+        std::cerr << "\rProgress: " << std::fixed << std::setprecision(1) << renderer.get_percentage() * 100 << "% " << std::flush;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::cerr << "\rProgress: 100.0% " << std::defaultfloat << std::endl;
+}
 
 int main(int argc, char* argv[])
 {
@@ -30,28 +149,77 @@ int main(int argc, char* argv[])
     std::cerr << "Initializing Renderer" << std::endl;
 
     //Render Settings
-    const std::string filename = get_filename(argc, argv);
+    render_options options;
+    if (!parse_options(argc, argv, options))
+        return 1;
+    const scene_description& description = *find_scene(options.scene);
 
     //Camera Settings
-    camera_settings camset{ {13, 6, 0 }, {0,0,0} };
-    camera cam(camset, 720);
+    camera cam(description.camset, options.width, options.height);
 
     //Render
-    threaded_renderer renderer(cam.image_width, cam.image_height, 32, 200, 32);
-    preview_gui gui(filename, cam.image_width, cam.image_height);
+    threaded_renderer renderer(cam.image_width, cam.image_height, 32, options.samples, options.max_depth, false, options.threads);
+    renderer.limits = options.limits;
 
     std::cerr << "Initializing Scene" << std::endl;
 
     // World
-    hittable_list scene = random_scene();
+    auto phase_start = phase_clock::now();
+    hittable_list scene = description.build();
+    light_list lights(scene); // emitters for next event estimation
+    const double scene_seconds = seconds_since(phase_start);
 
     std::cerr << "Building BVH" << std::endl;
-    auto bvh_scene = bvh_node(scene);
+    phase_start = phase_clock::now();
+    auto bvh_scene = bvh_node(scene, bvh_split_method::binned_sah, renderer.num_threads);
+    const double bvh_seconds = seconds_since(phase_start);
+    bvh_scene.build_stats().print(std::cerr); // only the scene BVH, not the ones of the meshes in it
+
+    phase_start = phase_clock::now();
+    double render_seconds = 0, write_seconds = 0;
+    bool saved = true;
+#ifdef GUI_SUPPORT
+    if (!options.headless)
+    {
+        // The window writes the image itself once it is closed
+        preview_gui gui(options.png_path, options.exr_path, cam.image_width, cam.image_height);
+        saved = gui.open_gui(renderer, bvh_scene, cam, &lights) == 0;
+        render_seconds = seconds_since(phase_start);
+    }
+    else
+#endif // GUI_SUPPORT
+    {
+        render_headless(renderer, bvh_scene, cam, &lights);
+        render_seconds = seconds_since(phase_start);
 
-    gui.open_gui(renderer, bvh_scene, cam);
+        phase_start = phase_clock::now();
+        saved = write_png_file(options.png_path.c_str(), cam.image_width, cam.image_height, renderer.pixels);
+        if (saved)
+            std::cerr << "Saved image to " << options.png_path << std::endl;
+#ifdef EXR_SUPPORT
+        saved = write_exr_file(options.exr_path.c_str(), cam.image_width, cam.image_height, renderer.pixels) && saved;
+#endif // EXR_SUPPORT
+        write_seconds = seconds_since(phase_start);
+    }
 
     const auto elapsed = std::chrono::high_resolution_clock::now() - start;
 
-    std::cerr << "\nRender took: " << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()*1e-3 << "s\n";
-    return 0;
-}
\ No newline at end of file
+    const double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()*1e-3;
+    std::cerr << "\nRender took: " << seconds << "s\n";
+    std::cerr << std::setprecision(3) << "Scene " << scene_seconds << "s, BVH " << bvh_seconds << "s, render " << render_seconds
+              << "s, write " << write_seconds << "s\n";
+    // The counters cover the last frame only, in the preview window that isn't what render_seconds measured
+    if (options.headless)
+    {
+#ifdef SINGLE_PRECISION
+        std::cerr << "Traced " << renderer.rays_traced << " rays (" << renderer.rays_traced / render_seconds * 1e-6 << " Mrays/s, single precision)\n";
+#else
+        std::cerr << "Traced " << renderer.rays_traced << " rays (" << renderer.rays_traced / render_seconds * 1e-6 << " Mrays/s, double precision)\n";
+#endif
+        std::cerr << "Took " << renderer.samples_traced << " samples (" << renderer.samples_traced / render_seconds * 1e-6 << " Msamples/s)\n";
+    }
+    if (renderer.progressive)
+        std::cerr << static_cast<int>(renderer.limits.error_percentile * 100) << "% of the pixels have a relative error below " << renderer.get_achieved_error() << "\n";
+    // Batch jobs have to notice when the image is missing
+    return saved ? 0 : 1;
+}
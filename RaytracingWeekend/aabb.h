@@ -8,13 +8,13 @@ public:
 
 	point3 min() const { return minimum; }
 	point3 max() const { return maximum; }
-    point3 center() const { return (minimum + maximum) * 0.5; }
-    vec3 extent() const { return (maximum - minimum)*0.5; }
-    double surface_area() const {
-        return 2. * (extent().x * extent().y + extent().x * extent().z + extent().y * extent().z);
+    point3 center() const { return (minimum + maximum) * real(0.5); }
+    vec3 extent() const { return (maximum - minimum)*real(0.5); }
+    real surface_area() const {
+        return 2 * (extent().x * extent().y + extent().x * extent().z + extent().y * extent().z);
     }
 
-    inline bool hit(const ray& r, double t_min, double t_max) const {
+    inline bool hit(const ray& r, real t_min, real t_max) const {
         // Slightly More performant hit test 
         const auto invDir = r.invdir();
 		auto t0 = (min() - r.origin())*invDir;
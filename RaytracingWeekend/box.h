@@ -9,7 +9,7 @@ constexpr short Bottom = 3;
 constexpr short Left = 4;
 constexpr short Right = 5;
 
-double max(const vec3& vv) {
+real max(const vec3& vv) {
     return glm::max(vv.x, glm::max(vv.y, vv.z));
 }
 
@@ -17,10 +17,10 @@ int indexOfMaxComponent(const vec3& v) {
     return (v.x > v.y) ? ((v.x > v.z) ? 0 : 2) : ((v.y > v.z) ? 1 : 2);
 }
 
-class box : public hittable {
+class box final : public hittable {
 public:
     box(const point3& p0, const point3& p1, shared_ptr<material> ptr) : _aabb(p0, p1), mat_ptr(ptr) {
-        radius = (_aabb.max() - _aabb.min()) * 0.5;
+        radius = (_aabb.max() - _aabb.min()) * real(0.5);
     }
 
     bool bounding_box(aabb& output_box) const override {
@@ -28,7 +28,23 @@ public:
         return true;
     }
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        // Same slab test as hit(), without the normal
+        vec3 m = r.invdir();
+        vec3 n = m * (r.origin() - _aabb.center());
+        vec3 k = glm::abs(m) * radius;
+        vec3 t1 = -n - k;
+        vec3 t2 = -n + k;
+
+        real tN = glm::max(glm::max(t1.x, t1.y), t1.z);
+        real tF = glm::min(glm::min(t2.x, t2.y), t2.z);
+        if (tN > tF || tF < 0.0) return false;
+
+        const real t = (tN > 0.0) ? tN : tF;
+        return t >= t_min && t <= t_max;
+    }
+
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
         // https://iquilezles.org/articles/boxfunctions/
 
         vec3 m = r.invdir(); // can precompute if traversing a set of aligned boxes
@@ -37,22 +53,26 @@ public:
         vec3 t1 = -n - k;
         vec3 t2 = -n + k;
 
-        double tN = glm::max(glm::max(t1.x, t1.y), t1.z);
-        double tF = glm::min(glm::min(t2.x, t2.y), t2.z);
+        real tN = glm::max(glm::max(t1.x, t1.y), t1.z);
+        real tF = glm::min(glm::min(t2.x, t2.y), t2.z);
 
         if (tN > tF || tF < 0.0) return false; // no intersection
 
+        // Check the range before touching rec, a closer hit might already be stored in it
+        const real t = (tN > 0.0) ? tN : tF;
+        if (t < t_min || t > t_max) return false;
+
         rec.front_face = (tN > 0.0);
         rec.normal = (tN > 0.0) ? step(vec3(tN), t1) : // ro ouside the box
             step(t2, vec3(tF));  // ro inside the box
         rec.normal *= -glm::sign(r.direction());
 
         // Setup the rest of the hit record
-        rec.t = (tN > 0.0) ? tN : tF;
+        rec.t = t;
         rec.p = r.at(rec.t);
         rec.mat_ptr = mat_ptr.get();
 
-        return rec.t >= t_min && rec.t <= t_max;
+        return true;
     }
 
 public:
@@ -66,9 +86,10 @@ private:
 
 class rotate_y : public hittable {
 public:
-    rotate_y(shared_ptr<hittable> p, double angle);
+    rotate_y(shared_ptr<hittable> p, real angle);
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 
     virtual bool bounding_box(aabb& output_box) const override {
         output_box = bbox;
@@ -80,11 +101,11 @@ public:
     bool hasbox;
     aabb bbox;
 private:
-    double sin_theta;
-    double cos_theta;
+    real sin_theta;
+    real cos_theta;
 };
 
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
+rotate_y::rotate_y(shared_ptr<hittable> p, real angle) : ptr(p) {
     auto radians = glm::radians(angle);
     sin_theta = sin(radians);
     cos_theta = cos(radians);
@@ -117,7 +138,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -144,4 +165,17 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     rec.p = p;
     rec.normal = normal;
     return true;
+}
+
+bool rotate_y::occluded(const ray& r, real t_min, real t_max) const {
+    auto origin = r.origin();
+    auto direction = r.direction();
+
+    origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+    origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+
+    direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+    direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+    return ptr->occluded(ray(origin, direction, r.lambda()), t_min, t_max);
 }
\ No newline at end of file
@@ -3,296 +3,811 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "primitive_store.h"
 #include <algorithm>
 #include <functional>
 #include <array>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <iostream>
+#include <future>
+#include <bit>
+#include <cassert>
+
+#include "wide_bvh.h"
+
+// The BVH is stored as a flat array of nodes in depth first order. The first child of an interior node
+// is always the next node in the array, so only the offset of the second child has to be stored.
+// Bounds are stored as floats (rounded outwards), which keeps a node at 32 bytes = half a cache line.
+struct linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    union {
+        uint32_t primitives_offset;   // leaf
+        uint32_t second_child_offset; // interior
+    };
+    uint16_t n_primitives; // 0 -> interior node
+    uint8_t axis;          // interior node split axis
+    uint8_t pad[1];
+
+    bool is_leaf() const { return n_primitives > 0; }
+};
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fit exactly into half a cache line");
+
+// Per primitive data needed during construction, so the virtual bounding_box is only called once per primitive
+struct bvh_primitive_info {
+    aabb bounds;
+    point3 centroid;
+    size_t index;
+};
 
-//TODO: This implementation is very inefficient. The BVH should be stored in a vector and not as a recursive tree on the stack
+typedef std::vector<bvh_primitive_info>::iterator bvh_primitive_iterator;
+
+enum class bvh_split_method {
+    median,     // split at the median centroid of the longest axis
+    binned_sah, // surface area heuristic evaluated at a fixed number of bins per axis
+    sweep_sah   // surface area heuristic evaluated between every pair of neighbouring primitives, slow but exact
+};
+
+struct bvh_build_stats {
+    double sah_cost = 0;
+    double build_time_ms = 0;
+    int max_depth = 0;
+    size_t n_nodes = 0;
+    size_t n_leaves = 0;
+    size_t n_wide_nodes = 0;
+    std::array<size_t, 9> leaf_size_histogram{}; // index = primitives per leaf
+
+    void merge(const bvh_build_stats& other);
+    void print(std::ostream& out) const;
+};
+
+inline float round_down(double x) {
+    float f = static_cast<float>(x);
+    return (f > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double x) {
+    float f = static_cast<float>(x);
+    return (f < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Splits [start, end) into one chunk per thread and runs f(chunk_start, chunk_end) on each chunk concurrently
+template<class F>
+auto parallel_chunks(bvh_primitive_iterator start, bvh_primitive_iterator end, int threads, F f) {
+    typedef decltype(f(start, end)) result_type;
+    std::vector<std::future<result_type>> futures;
+    const size_t chunk_size = (end - start + threads - 1) / threads;
+    for (auto chunk_start = start; chunk_start < end; chunk_start += std::min<size_t>(chunk_size, end - chunk_start)) {
+        const auto chunk_end = chunk_start + std::min<size_t>(chunk_size, end - chunk_start);
+        futures.push_back(std::async(std::launch::async, f, chunk_start, chunk_end));
+    }
+
+    std::vector<result_type> results;
+    results.reserve(futures.size());
+    for (auto& future : futures)
+        results.push_back(future.get());
+    return results;
+}
+
+// BVH over primitives that are only known by their index. The owner provides the bounds during construction
+// and intersects the primitives of the leaves in hit(), so the same tree serves the scene (bvh_node) and
+// the triangles of a mesh (triangle_mesh).
+class bvh_tree {
+public:
+    bvh_tree() {};
+    // bounds_of(i) returns the bounding box of primitive i in [0, count), it is called concurrently
+    bvh_tree(size_t count, const std::function<aabb(size_t)>& bounds_of,
+        bvh_split_method method = bvh_split_method::binned_sah, int num_threads = default_thread_count());
+
+    // hit_primitive(i, r, t_min, t_max, rec) intersects the i-th primitive in leaf order (see take_primitive_order)
+    template<class F>
+    bool hit(const ray& r, real t_min, real t_max, hit_record& rec, const F& hit_primitive) const {
+#if BVH_WIDTH > 2
+        return hit_wide(r, t_min, t_max, rec, hit_primitive);
+#else
+        return hit_binary(r, t_min, t_max, rec, hit_primitive);
+#endif
+    }
+
+    // Any hit query for shadow rays: returns as soon as occluded_primitive(i, r, t_min, t_max) finds an
+    // intersection in [t_min, t_max], without ordering the children or narrowing t_max
+    template<class F>
+    bool occluded(const ray& r, real t_min, real t_max, const F& occluded_primitive) const {
+#if BVH_WIDTH > 2
+        return occluded_wide(r, t_min, t_max, occluded_primitive);
+#else
+        return occluded_binary(r, t_min, t_max, occluded_primitive);
+#endif
+    }
+
+    // Index of the primitive (as passed to bounds_of) for every position in leaf order. The owner reorders its
+    // primitives once after construction, so every leaf references a contiguous range of them.
+    std::vector<uint32_t> take_primitive_order() { return std::move(primitive_order); }
+
+    bool empty() const { return nodes.empty() && wide_nodes.empty(); }
+    const aabb& bounds() const { return box; }
+
+    size_t memory_usage() const {
+        return nodes.size() * sizeof(linear_bvh_node) + wide_nodes.size() * sizeof(wide_bvh_node<BVH_WIDTH>);
+    }
+
+    const bvh_build_stats& build_stats() const { return stats; }
+private:
+    // Builds the subtree for [start, end) into out, node offsets are relative to the start of out.
+    // Subtrees are built concurrently as long as there is more than one thread left for them.
+    uint32_t build(bvh_primitive_iterator start, bvh_primitive_iterator end, int depth, int threads, std::vector<linear_bvh_node>& out, bvh_build_stats& out_stats) const;
+    // Converts the binary subtree below an interior node into wide nodes, returns the index of the new wide node
+    uint32_t collapse(uint32_t binary_index);
+
+    template<class F>
+    bool hit_binary(const ray& r, real t_min, real t_max, hit_record& rec, const F& hit_primitive) const;
+    template<class F>
+    bool hit_wide(const ray& r, real t_min, real t_max, hit_record& rec, const F& hit_primitive) const;
+    template<class F>
+    bool hit_leaf(uint32_t offset, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec, const F& hit_primitive) const;
+    template<class F>
+    bool occluded_binary(const ray& r, real t_min, real t_max, const F& occluded_primitive) const;
+    template<class F>
+    bool occluded_wide(const ray& r, real t_min, real t_max, const F& occluded_primitive) const;
+
+    // The split functions return the SAH cost of the split and store the partition point in mid
+    double split_sah(bvh_primitive_iterator start, bvh_primitive_iterator end, const aabb& bounds, const aabb& centroid_bounds, int threads, bvh_primitive_iterator& mid) const;
+    double split_sweep_sah(bvh_primitive_iterator start, bvh_primitive_iterator end, const aabb& bounds, bvh_primitive_iterator& mid) const;
+    bvh_primitive_iterator split_max(bvh_primitive_iterator start, bvh_primitive_iterator end, int dim) const;
+
+    static constexpr int median_leaf_size = 4;
+    static constexpr int max_leaf_size = 8; // Never allow for more than 8 objects in a leaf
+    static constexpr int max_stack_depth = 64;
+    // Minimum number of primitives before a subtree gets its own thread, or the binning pass is split across threads
+    static constexpr size_t parallel_build_threshold = 4096;
+    static constexpr size_t parallel_binning_threshold = 65536;
+    static constexpr size_t sweep_sah_threshold = 16;
+    // Relative cost of visiting a node compared to intersecting a primitive
+    static constexpr double sah_traversal_cost = 0.125;
+    static constexpr double sah_intersection_cost = 1.;
+    // Compensate for the float rounding of the ray origin, so grazing rays don't miss their boxes
+    static constexpr float robust_scale = 1.f + 4.f * std::numeric_limits<float>::epsilon();
+
+    bvh_split_method split_method = bvh_split_method::binned_sah;
+    bvh_build_stats stats;
+
+    std::vector<linear_bvh_node> nodes; // binary BVH, only kept for traversal if BVH_WIDTH is 2
+    std::vector<wide_bvh_node<BVH_WIDTH>> wide_nodes;
+    std::vector<uint32_t> primitive_order;
+    std::vector<bvh_primitive_info> primitive_info; // only used during construction
+    aabb box;
+};
 
 class bvh_node : public hittable {
 public:
     bvh_node() {};
-    bvh_node(std::vector<shared_ptr<hittable>>::iterator, std::vector<shared_ptr<hittable>>::iterator);
+    bvh_node(std::vector<shared_ptr<hittable>>::iterator, std::vector<shared_ptr<hittable>>::iterator,
+        bvh_split_method method = bvh_split_method::binned_sah, int num_threads = default_thread_count());
 
-    bvh_node(hittable_list& list)
-        : bvh_node(list.begin(), list.end())
+    bvh_node(hittable_list& list, bvh_split_method method = bvh_split_method::binned_sah, int num_threads = default_thread_count())
+        : bvh_node(list.begin(), list.end(), method, num_threads)
     {}
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return tree.hit(r, t_min, t_max, rec, [this](uint32_t i, const ray& r, real t_min, real t_max, hit_record& rec) {
+            return store.hit(primitives[i], r, t_min, t_max, rec);
+        });
+    }
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return tree.occluded(r, t_min, t_max, [this](uint32_t i, const ray& r, real t_min, real t_max) {
+            return store.occluded(primitives[i], r, t_min, t_max);
+        });
+    }
 
     virtual bool bounding_box(aabb& output_box) const override;
-private:
-    void split_sah(std::vector<shared_ptr<hittable>>::iterator start, std::vector<shared_ptr<hittable>>::iterator end, int dim);
-    void split_sa(std::vector<shared_ptr<hittable>>::iterator start, std::vector<shared_ptr<hittable>>::iterator end, int dim);
-    void split_max(std::vector<shared_ptr<hittable>>::iterator start, std::vector<shared_ptr<hittable>>::iterator end, int dim);
 
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb box;
+    size_t memory_usage() const {
+        return tree.memory_usage() + primitives.size() * sizeof(primitive_ref) + store.memory_usage();
+    }
+
+    const bvh_build_stats& build_stats() const { return tree.build_stats(); }
+private:
+    bvh_tree tree;
+    std::vector<primitive_ref> primitives; // in leaf order, so that every leaf references a contiguous range
+    primitive_store store;
 };
 
 bool bvh_node::bounding_box(aabb& output_box) const {
-    output_box = aabb(box);
+    output_box = tree.bounds();
     return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    rec.traversal_cost++;
-    if (!box.hit(r, t_min, t_max))
-        return false;
-
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+inline bool node_hit(const linear_bvh_node& node, const bvh_ray& r, float t_min, float t_max) {
+    // Slab test, using the sign of the direction to pick the near and far plane instead of min/max
+    const float* bounds[2] = { node.bounds_min, node.bounds_max };
+    for (int a = 0; a < 3; a++) {
+        const float t0 = (bounds[r.dir_is_neg[a]][a] - r.origin[a]) * r.inv_dir[a];
+        const float t1 = (bounds[1 - r.dir_is_neg[a]][a] - r.origin[a]) * r.inv_dir[a];
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+    }
+    return t_min <= t_max;
+}
 
-    return hit_left || hit_right;
+template<class F>
+inline bool bvh_tree::hit_leaf(uint32_t offset, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec, const F& hit_primitive) const {
+    bool hit_anything = false;
+    for (uint32_t i = offset; i < offset + count; i++) {
+        if (hit_primitive(i, r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+        }
+    }
+    return hit_anything;
 }
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
+template<class F>
+bool bvh_tree::hit_binary(const ray& r, real t_min, real t_max, hit_record& rec, const F& hit_primitive) const {
+    if (nodes.empty())
+        return false;
 
-    if (!a->bounding_box(box_a) || !b->bounding_box(box_b))
-        throw("No bounding box in bvh_node constructor.\n");
+    const bvh_ray ray_data(r);
+
+    bool hit_anything = false;
+    std::array<uint32_t, max_stack_depth> to_visit;
+    int to_visit_offset = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const linear_bvh_node& node = nodes[current];
+        rec.traversal_cost++;
+        if (node_hit(node, ray_data, static_cast<float>(t_min), static_cast<float>(t_max) * robust_scale)) {
+            if (node.is_leaf()) {
+                hit_anything |= hit_leaf(node.primitives_offset, node.n_primitives, r, t_min, t_max, rec, hit_primitive);
+                if (to_visit_offset == 0)
+                    break;
+                current = to_visit[--to_visit_offset];
+            }
+            else {
+                // build() caps the depth of the tree, so the stack can't overflow
+                assert(to_visit_offset < max_stack_depth);
+                // Visit the child that is closer along the ray first, the other one is put on the stack
+                if (ray_data.dir_is_neg[node.axis]) {
+                    to_visit[to_visit_offset++] = current + 1;
+                    current = node.second_child_offset;
+                }
+                else {
+                    to_visit[to_visit_offset++] = node.second_child_offset;
+                    current = current + 1;
+                }
+            }
+        }
+        else {
+            if (to_visit_offset == 0)
+                break;
+            current = to_visit[--to_visit_offset];
+        }
+    }
 
-    // Sort by centroid
-    return box_a.min()[axis]+box_a.max()[axis] < box_b.min()[axis]+box_b.max()[axis]; 
+    return hit_anything;
 }
 
+template<class F>
+bool bvh_tree::hit_wide(const ray& r, real t_min, real t_max, hit_record& rec, const F& hit_primitive) const {
+    if (wide_nodes.empty())
+        return false;
 
-inline double pair_axis_dist(std::pair<std::vector<shared_ptr<hittable>>::iterator, std::vector<shared_ptr<hittable>>::iterator> p, int axis) {
-    aabb box_a;
-    aabb box_b;
-    auto a = *p.first;
-    auto b = *p.second;
+    const bvh_ray ray_data(r);
 
-    if (!a->bounding_box(box_a) || !b->bounding_box(box_b))
-        throw("No bounding box in bvh_node constructor.\n");
+    struct stack_entry {
+        uint32_t index;
+        uint16_t count; // > 0 for leaves
+        float t_near;
+    };
+    bool hit_anything = false;
+    std::array<stack_entry, max_stack_depth * BVH_WIDTH> to_visit;
+    int to_visit_offset = 0;
+    to_visit[to_visit_offset++] = { 0, 0, -std::numeric_limits<float>::infinity() };
+
+    while (to_visit_offset > 0) {
+        const stack_entry current = to_visit[--to_visit_offset];
+        // A closer hit might have been found since this entry was pushed
+        if (current.t_near > static_cast<float>(t_max) * robust_scale)
+            continue;
+
+        if (current.count > 0) {
+            hit_anything |= hit_leaf(current.index, current.count, r, t_min, t_max, rec, hit_primitive);
+            continue;
+        }
+
+        const auto& node = wide_nodes[current.index];
+        rec.traversal_cost++;
+        alignas(32) float t_near[BVH_WIDTH];
+        int mask = intersect_wide_node(node, ray_data, static_cast<float>(t_min), static_cast<float>(t_max) * robust_scale, t_near);
+
+        // Sort the hit children by distance (insertion sort, there are at most BVH_WIDTH) and push the
+        // farthest first, so the nearest child is visited next
+        stack_entry hits[BVH_WIDTH];
+        int n_hits = 0;
+        while (mask) {
+            const int i = std::countr_zero(static_cast<unsigned>(mask));
+            mask &= mask - 1;
+            stack_entry entry{ node.child[i], node.count[i], t_near[i] };
+            int j = n_hits++;
+            for (; j > 0 && hits[j - 1].t_near < entry.t_near; j--)
+                hits[j] = hits[j - 1];
+            hits[j] = entry;
+        }
+        // Every level of the (depth capped) tree adds at most BVH_WIDTH - 1 entries
+        assert(to_visit_offset + n_hits <= static_cast<int>(to_visit.size()));
+        for (int i = 0; i < n_hits; i++)
+            to_visit[to_visit_offset++] = hits[i];
+    }
 
-    return box_b.max()[axis] - box_a.min()[axis];
+    return hit_anything;
 }
 
+template<class F>
+bool bvh_tree::occluded_binary(const ray& r, real t_min, real t_max, const F& occluded_primitive) const {
+    if (nodes.empty())
+        return false;
 
-bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
-    return box_compare(a, b, 0);
+    const bvh_ray ray_data(r);
+    std::array<uint32_t, max_stack_depth> to_visit;
+    int to_visit_offset = 0;
+    to_visit[to_visit_offset++] = 0;
+
+    while (to_visit_offset > 0) {
+        const uint32_t current = to_visit[--to_visit_offset];
+        const linear_bvh_node& node = nodes[current];
+        if (!node_hit(node, ray_data, static_cast<float>(t_min), static_cast<float>(t_max) * robust_scale))
+            continue;
+
+        if (node.is_leaf()) {
+            for (uint32_t i = node.primitives_offset; i < node.primitives_offset + node.n_primitives; i++)
+                if (occluded_primitive(i, r, t_min, t_max))
+                    return true;
+        }
+        else {
+            // The order doesn't matter for an any hit query, any intersection ends the traversal
+            assert(to_visit_offset + 2 <= max_stack_depth);
+            to_visit[to_visit_offset++] = node.second_child_offset;
+            to_visit[to_visit_offset++] = current + 1;
+        }
+    }
+    return false;
 }
 
-bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
-    return box_compare(a, b, 1);
-}
+template<class F>
+bool bvh_tree::occluded_wide(const ray& r, real t_min, real t_max, const F& occluded_primitive) const {
+    if (wide_nodes.empty())
+        return false;
+
+    const bvh_ray ray_data(r);
+    struct stack_entry {
+        uint32_t index;
+        uint16_t count; // > 0 for leaves
+    };
+    std::array<stack_entry, max_stack_depth * BVH_WIDTH> to_visit;
+    int to_visit_offset = 0;
+    to_visit[to_visit_offset++] = { 0, 0 };
+
+    while (to_visit_offset > 0) {
+        const stack_entry current = to_visit[--to_visit_offset];
+        if (current.count > 0) {
+            for (uint32_t i = current.index; i < current.index + current.count; i++)
+                if (occluded_primitive(i, r, t_min, t_max))
+                    return true;
+            continue;
+        }
 
-bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
-    return box_compare(a, b, 2);
+        const auto& node = wide_nodes[current.index];
+        alignas(32) float t_near[BVH_WIDTH];
+        int mask = intersect_wide_node(node, ray_data, static_cast<float>(t_min), static_cast<float>(t_max) * robust_scale, t_near);
+        assert(to_visit_offset + std::popcount(static_cast<unsigned>(mask)) <= static_cast<int>(to_visit.size()));
+        while (mask) {
+            const int i = std::countr_zero(static_cast<unsigned>(mask));
+            mask &= mask - 1;
+            to_visit[to_visit_offset++] = { node.child[i], node.count[i] };
+        }
+    }
+    return false;
 }
 
-void bvh_node::split_sa(const std::vector<shared_ptr<hittable>>::iterator start, const std::vector<shared_ptr<hittable>>::iterator end, int dim) {
-    auto comparator = (dim == 0) ? box_x_compare
-            : (dim == 1) ? box_y_compare
-            : box_z_compare;
+uint32_t bvh_tree::collapse(uint32_t binary_index) {
+    // Pulls up grandchildren of the binary node until the wide node is full, always opening the
+    // interior child with the largest surface area, since it is the most likely to be hit
+    auto area = [this](uint32_t i) {
+        const auto& n = nodes[i];
+        const float dx = n.bounds_max[0] - n.bounds_min[0], dy = n.bounds_max[1] - n.bounds_min[1], dz = n.bounds_max[2] - n.bounds_min[2];
+        return dx * dy + dx * dz + dy * dz;
+    };
 
-    size_t object_span = end - start;
-    std::sort(start, end, comparator);
-
-    std::vector<double> surface_area_left(object_span);
-    double half_sa = 0;
-    for(auto it = start; it < end; it++){
-        aabb objbox;
-        (*it)->bounding_box(objbox);
-        auto sa = objbox.surface_area();
-        half_sa += sa;
-        surface_area_left[it-start] = half_sa;
+    std::array<uint32_t, BVH_WIDTH> children;
+    int n_children = 0;
+    children[n_children++] = binary_index + 1;
+    children[n_children++] = nodes[binary_index].second_child_offset;
+    while (n_children < BVH_WIDTH) {
+        int largest = -1;
+        for (int i = 0; i < n_children; i++) {
+            if (!nodes[children[i]].is_leaf() && (largest < 0 || area(children[i]) > area(children[largest])))
+                largest = i;
+        }
+        if (largest < 0)
+            break;
+        const uint32_t opened = children[largest];
+        children[largest] = opened + 1;
+        children[n_children++] = nodes[opened].second_child_offset;
     }
-    half_sa /= 2.0;
 
-    auto midd = std::upper_bound(surface_area_left.begin(), surface_area_left.end(), half_sa);
-    if (midd == surface_area_left.begin()) {
-        midd++;
-    }
-    if (midd == surface_area_left.end()) {
-        midd--;
-    }
-    //std::copy(surface_area_left.begin(), surface_area_left.end(), std::ostream_iterator<double>(std::cout, " "));
-
-    std::cout << "Split at " << std::distance(surface_area_left.begin(), midd) << " of " << object_span << "\n";
-    auto mid = start + std::distance(surface_area_left.begin(), midd);
-    
-    if (object_span <= 4) {
-        left = make_shared<hittable_list>(start, mid - start);
-        right = make_shared<hittable_list>(mid, end - mid);
-    }else{
-        left = make_shared<bvh_node>(start, mid);
-        right = make_shared<bvh_node>(mid, end);
+    const uint32_t wide_index = static_cast<uint32_t>(wide_nodes.size());
+    wide_nodes.emplace_back();
+    for (int i = 0; i < n_children; i++) {
+        const auto& child = nodes[children[i]];
+        for (int a = 0; a < 3; a++) {
+            wide_nodes[wide_index].bounds[0][a][i] = child.bounds_min[a];
+            wide_nodes[wide_index].bounds[1][a][i] = child.bounds_max[a];
+        }
+        if (child.is_leaf()) {
+            wide_nodes[wide_index].child[i] = child.primitives_offset;
+            wide_nodes[wide_index].count[i] = child.n_primitives;
+        }
+        else {
+            const uint32_t child_index = collapse(children[i]);
+            wide_nodes[wide_index].child[i] = child_index;
+        }
     }
+    return wide_index;
 }
 
-void bvh_node::split_max(const std::vector<shared_ptr<hittable>>::iterator start, const std::vector<shared_ptr<hittable>>::iterator end, int dim) {
-    auto comparator = (dim == 0) ? box_x_compare
-            : (dim == 1) ? box_y_compare
-            : box_z_compare;
+inline bool box_compare(const bvh_primitive_info& a, const bvh_primitive_info& b, int axis) {
+    // Sort by centroid
+    return a.centroid[axis] < b.centroid[axis];
+}
+
+inline aabb empty_box() {
+    return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+}
 
+bvh_primitive_iterator bvh_tree::split_max(bvh_primitive_iterator start, bvh_primitive_iterator end, int dim) const {
     size_t object_span = end - start;
     auto mid = start + object_span / 2;
-    std::partial_sort(start, mid, end, comparator);
-
-    if (object_span <= 4) {
-        left = make_shared<hittable_list>(start, mid - start);
-        right = make_shared<hittable_list>(mid, end - mid);
-    }else{
-        left = make_shared<bvh_node>(start, mid);
-        right = make_shared<bvh_node>(mid, end);
-    }
+    std::nth_element(start, mid, end, std::bind(box_compare, std::placeholders::_1, std::placeholders::_2, dim));
+    return mid;
 }
 
-void bvh_node::split_sah(const std::vector<shared_ptr<hittable>>::iterator start, const std::vector<shared_ptr<hittable>>::iterator end, int dim) {
+double bvh_tree::split_sah(bvh_primitive_iterator start, bvh_primitive_iterator end, const aabb& bounds, const aabb& centroid_bounds, int threads, bvh_primitive_iterator& mid) const {
     struct BucketInfo {
         int count = 0;
-        aabb bounds;
+        aabb bounds = empty_box();
     };
-    double minScore=std::numeric_limits<double>::max();
-    int minDim=0;
-    int min_cost_split;
     constexpr int num_bins = 24;
+    typedef std::array<std::array<BucketInfo, num_bins>, 3> Bins;
 
-    for (dim = 0; dim < 3; dim++) {
-        // Create bins to store the splitting cost for each possible split
-       
-        std::array<BucketInfo, num_bins> bins;
+    auto bin_of = [&centroid_bounds](const bvh_primitive_info& info, int dim) {
+        const double extent = centroid_bounds.max()[dim] - centroid_bounds.min()[dim];
+        return std::min(num_bins - 1, static_cast<int>((info.centroid[dim] - centroid_bounds.min()[dim]) / extent * num_bins));
+    };
 
+    // Assign the objects to the bins of all three axes. Near the root this is split across threads and merged afterwards.
+    auto fill_bins = [&bin_of, &centroid_bounds](bvh_primitive_iterator chunk_start, bvh_primitive_iterator chunk_end) {
+        Bins bins;
+        for (int dim = 0; dim < 3; dim++) {
+            if (centroid_bounds.max()[dim] <= centroid_bounds.min()[dim])
+                continue;
+            for (auto it = chunk_start; it < chunk_end; it++) {
+                auto& bin = bins[dim][bin_of(*it, dim)];
+                bin.count++;
+                bin.bounds = surrounding_box(bin.bounds, it->bounds);
+            }
+        }
+        return bins;
+    };
 
-        // Assign the objects to the bins
-        for (auto it = start; it < end; it++) {
-            auto object = *it;
-            aabb objbox{};
-            object->bounding_box(objbox);
+    Bins all_bins;
+    if (threads > 1 && static_cast<size_t>(end - start) >= parallel_binning_threshold) {
+        for (const auto& chunk_bins : parallel_chunks(start, end, threads, fill_bins)) {
+            for (int dim = 0; dim < 3; dim++) {
+                for (int i = 0; i < num_bins; i++) {
+                    all_bins[dim][i].count += chunk_bins[dim][i].count;
+                    all_bins[dim][i].bounds = surrounding_box(all_bins[dim][i].bounds, chunk_bins[dim][i].bounds);
+                }
+            }
+        }
+    }
+    else {
+        all_bins = fill_bins(start, end);
+    }
+
+    double min_cost = infinity;
+    int min_dim = -1;
+    int min_cost_split = 0;
+
+    for (int dim = 0; dim < 3; dim++) {
+        if (centroid_bounds.max()[dim] <= centroid_bounds.min()[dim])
+            continue; // all centroids in the same plane, nothing to split on this axis
 
-            // Get the bin index of the object
-            int bin_index = (objbox.center()[dim] - box.min()[dim]) / (box.max()[dim] - box.min()[dim]) * num_bins;
+        const auto& bins = all_bins[dim];
 
-            // Add the object to the bucket
-            bins[bin_index].count++;
-            if (bins[bin_index].count <= 1)
-                bins[bin_index].bounds = objbox;
-            else
-                bins[bin_index].bounds = surrounding_box(bins[bin_index].bounds, objbox);
+        // Sweep from the right to get the cost contribution of everything right of each split plane,
+        // then sweep from the left and combine both, so every split is evaluated in O(1)
+        std::array<double, num_bins - 1> cost_right;
+        BucketInfo right;
+        for (int i = num_bins - 1; i > 0; i--) {
+            right.count += bins[i].count;
+            right.bounds = surrounding_box(right.bounds, bins[i].bounds);
+            cost_right[i - 1] = right.count > 0 ? right.count * right.bounds.surface_area() : 0;
         }
 
-        // Compute splitting costs
-        std::array<double, num_bins - 1> cost;
+        BucketInfo left;
         for (int i = 0; i < num_bins - 1; i++) {
-            BucketInfo box0, box1;
-
-            for (int j = 0; j <= i; j++) {
-                if (bins[j].count > 0) {
-                    if (box0.count == 0)
-                        box0.bounds = bins[j].bounds;
-                    else
-                        box0.bounds = surrounding_box(box0.bounds, bins[j].bounds);
-                    box0.count += bins[j].count;
-                }
+            left.count += bins[i].count;
+            left.bounds = surrounding_box(left.bounds, bins[i].bounds);
+            const double cost_left = left.count > 0 ? left.count * left.bounds.surface_area() : 0;
+            const double cost = sah_traversal_cost + sah_intersection_cost * (cost_left + cost_right[i]) / bounds.surface_area();
+            if (cost < min_cost && left.count > 0 && left.count < end - start) {
+                min_cost = cost;
+                min_dim = dim;
+                min_cost_split = i;
             }
-            for (int j = i + 1; j < num_bins; j++) {
-                if (bins[j].count > 0) {
-                    if (box1.count == 0)
-                        box1.bounds = bins[j].bounds;
-                    else
-                        box1.bounds = surrounding_box(box1.bounds, bins[j].bounds);
-                    box1.count += bins[j].count;
-                }
-            }
-
-            cost[i] = 0.125 + (box0.count * box0.bounds.surface_area() + box1.count * box1.bounds.surface_area()) / box.surface_area();
-            //std::cout << "c=" << cost[i]<< "sa="<< bins[i].bounds.surface_area()<< ", ";
         }
+    }
 
-        // Find the best split
-        auto it = std::min_element(cost.begin(), cost.end());
-        auto min_cost_itr = std::distance(cost.begin(), it);
+    if (min_dim < 0)
+        return infinity;
 
-        if (cost[min_cost_itr] < minScore) {
-			minScore = cost[min_cost_itr];
-			minDim = dim;
+    mid = std::partition(start, end, [&bin_of, min_cost_split, min_dim](const bvh_primitive_info& info) {
+        return bin_of(info, min_dim) <= min_cost_split;
+    });
+    return min_cost;
+}
 
-            min_cost_split = min_cost_itr;
-		}
-    }
-    dim = minDim;
+double bvh_tree::split_sweep_sah(bvh_primitive_iterator start, bvh_primitive_iterator end, const aabb& bounds, bvh_primitive_iterator& mid) const {
+    // Exact SAH: evaluate the split between every pair of neighbouring primitives (sorted by centroid) on all axes
+    const size_t object_span = end - start;
+    std::vector<double> cost_right(object_span);
 
+    double min_cost = infinity;
+    int min_dim = -1;
+    size_t min_cost_split = 0;
 
+    for (int dim = 0; dim < 3; dim++) {
+        std::sort(start, end, std::bind(box_compare, std::placeholders::_1, std::placeholders::_2, dim));
 
-    //std::cout<< "Cost " << *it <<" at split "<< min_cost_itr << std::endl;
-    std::vector<shared_ptr<hittable>>::iterator mid;
-    // Split the list
-    if (std::distance(start, end) > 8) { // Never allow for more than 8 objects in a leaf
-        mid = std::partition(start, end, [min_cost_split, dim, this](const shared_ptr<hittable>& object) {
-            aabb objbox;
-            object->bounding_box(objbox);
-            int bin_index = (objbox.center()[dim] - box.min()[dim]) / (box.max()[dim] - box.min()[dim]) * num_bins;
-            return bin_index < min_cost_split;
-        });
-        if (mid == start)
-            mid++;
+        aabb right = empty_box();
+        for (size_t i = object_span - 1; i > 0; i--) {
+            right = surrounding_box(right, start[i].bounds);
+            cost_right[i - 1] = (object_span - i) * right.surface_area();
+        }
 
-    }else{
-        // Split at the centroid of our bounding box
-        std::sort(start, end, std::bind(box_compare, std::placeholders::_1, std::placeholders::_2, dim));
-        mid = start + std::distance(start, end) / 2;
+        aabb left = empty_box();
+        for (size_t i = 0; i < object_span - 1; i++) {
+            left = surrounding_box(left, start[i].bounds);
+            const double cost = sah_traversal_cost + sah_intersection_cost * ((i + 1) * left.surface_area() + cost_right[i]) / bounds.surface_area();
+            if (cost < min_cost) {
+                min_cost = cost;
+                min_dim = dim;
+                min_cost_split = i;
+            }
+        }
     }
 
-    //std::cout << "Sort mid: " << std::distance(start, mid) << " of " << leaf_cost << "\n";
+    if (min_dim != 2) // the range is still sorted along the last axis
+        std::sort(start, end, std::bind(box_compare, std::placeholders::_1, std::placeholders::_2, min_dim));
+    mid = start + min_cost_split + 1;
+    return min_cost;
+}
 
-    if (std::distance(start, end) <= 0) {
-        std::cout << "???" << std::distance(start, end);
-        return;
-    }
-    else if (std::distance(start, end) == 1) {
-        left = right = *start;
-        return;
+uint32_t bvh_tree::build(bvh_primitive_iterator start, bvh_primitive_iterator end, int depth, int threads, std::vector<linear_bvh_node>& out, bvh_build_stats& out_stats) const {
+    const uint32_t node_index = static_cast<uint32_t>(out.size());
+    out.emplace_back();
+
+    struct Bounds {
+        aabb bounds = empty_box();
+        aabb centroid_bounds = empty_box();
+    };
+    auto compute_bounds = [](bvh_primitive_iterator chunk_start, bvh_primitive_iterator chunk_end) {
+        Bounds b;
+        for (auto it = chunk_start; it < chunk_end; it++) {
+            b.bounds = surrounding_box(b.bounds, it->bounds);
+            b.centroid_bounds = surrounding_box(b.centroid_bounds, aabb(it->centroid, it->centroid));
+        }
+        return b;
+    };
+
+    const size_t object_span = end - start;
+    Bounds node_bounds;
+    if (threads > 1 && object_span >= parallel_binning_threshold) {
+        for (const auto& b : parallel_chunks(start, end, threads, compute_bounds)) {
+            node_bounds.bounds = surrounding_box(node_bounds.bounds, b.bounds);
+            node_bounds.centroid_bounds = surrounding_box(node_bounds.centroid_bounds, b.centroid_bounds);
+        }
     }
-    else if (std::distance(start, end) == 2) {
-        left = *start;
-        right = *(end - 1);
-        return;
-    }else {
-        left = make_shared<bvh_node>(start, mid);
-        right = make_shared<bvh_node>(mid, end);
+    else {
+        node_bounds = compute_bounds(start, end);
     }
-}
-
+    const aabb& bounds = node_bounds.bounds;
+    const aabb& centroid_bounds = node_bounds.centroid_bounds;
 
-bvh_node::bvh_node(std::vector<shared_ptr<hittable>>::iterator start, std::vector<shared_ptr<hittable>>::iterator end) {
     // select the largest axis to split the bvh
-    int axis;
-    auto minmax_x = std::minmax_element(start, end, box_x_compare);
-    auto minmax_y = std::minmax_element(start, end, box_y_compare);
-    auto minmax_z = std::minmax_element(start, end, box_z_compare);
-
-    (*start)->bounding_box(box);
-    for (auto it = start; it < end; it++) {
-        auto object = *it;
-        aabb objbox{};
-        object->bounding_box(objbox);
-        box = surrounding_box(box, objbox);
+    const vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+    const int axis = (extent.x > extent.y) ? ((extent.x > extent.z) ? 0 : 2) : ((extent.y > extent.z) ? 1 : 2);
+
+    // The traversal stacks hold max_stack_depth entries, so the tree must not get any deeper. Median splits need
+    // at most bit_width(object_span) more levels, close to the limit they are used instead of the SAH.
+    bool make_leaf = object_span == 1 || depth >= max_stack_depth - 1;
+    const bool depth_limited = depth + static_cast<int>(std::bit_width(object_span)) >= max_stack_depth - 1;
+    bvh_primitive_iterator mid = start + object_span / 2;
+    if (!make_leaf) {
+        const double leaf_cost = sah_intersection_cost * object_span;
+        switch (depth_limited ? bvh_split_method::median : split_method) {
+        case bvh_split_method::median:
+            make_leaf = object_span <= median_leaf_size;
+            if (!make_leaf)
+                mid = split_max(start, end, axis);
+            break;
+        case bvh_split_method::binned_sah:
+        case bvh_split_method::sweep_sah: {
+            // Small nodes have fewer primitives than bins, the exact sweep is cheaper and better for them
+            const double split_cost = (split_method == bvh_split_method::binned_sah && object_span > sweep_sah_threshold)
+                ? split_sah(start, end, bounds, centroid_bounds, threads, mid)
+                : split_sweep_sah(start, end, bounds, mid);
+            // Only split if it is cheaper than intersecting all primitives, or the leaf would get too large
+            make_leaf = object_span <= max_leaf_size && leaf_cost <= split_cost;
+            if (!make_leaf && split_cost == infinity) {
+                // All centroids coincide, a median split still produces valid (if overlapping) children
+                mid = split_max(start, end, axis);
+            }
+            break;
+        }
+        }
     }
 
-    if (pair_axis_dist(minmax_x, 0) > std::fmax(pair_axis_dist(minmax_y, 1), pair_axis_dist(minmax_z, 2))) {
-        axis = 0;
+    if (make_leaf) {
+        out[node_index].primitives_offset = static_cast<uint32_t>(start - primitive_info.begin());
+        out[node_index].n_primitives = static_cast<uint16_t>(object_span);
+        out_stats.n_leaves++;
+        out_stats.leaf_size_histogram[std::min(object_span, out_stats.leaf_size_histogram.size() - 1)]++;
+        out_stats.max_depth = std::max(out_stats.max_depth, depth);
     }
-    else if (pair_axis_dist(minmax_y, 1) > pair_axis_dist(minmax_z, 2)) {
-        axis = 1;
+    else if (threads > 1 && object_span >= parallel_build_threshold) {
+        // Build the left subtree on a new thread, the right one on this thread, both into their own node
+        // arrays. Afterwards they are appended in depth first order and their child offsets are shifted.
+        const int left_threads = threads / 2;
+        std::vector<linear_bvh_node> left_nodes, right_nodes;
+        bvh_build_stats left_stats, right_stats;
+        auto left_task = std::async(std::launch::async, [&]() {
+            build(start, mid, depth + 1, left_threads, left_nodes, left_stats);
+        });
+        build(mid, end, depth + 1, threads - left_threads, right_nodes, right_stats);
+        left_task.get();
+
+        auto append = [&out](const std::vector<linear_bvh_node>& subtree) {
+            const uint32_t base = static_cast<uint32_t>(out.size());
+            out.insert(out.end(), subtree.begin(), subtree.end());
+            for (auto it = out.begin() + base; it < out.end(); it++) {
+                if (!it->is_leaf())
+                    it->second_child_offset += base;
+            }
+            return base;
+        };
+        append(left_nodes);
+        const uint32_t second_child = append(right_nodes);
+        out_stats.merge(left_stats);
+        out_stats.merge(right_stats);
+
+        out[node_index].second_child_offset = second_child;
+        out[node_index].n_primitives = 0;
+        out[node_index].axis = static_cast<uint8_t>(axis);
     }
-    else if (pair_axis_dist(minmax_y, 1) < pair_axis_dist(minmax_z, 2)) {
-        axis = 2;
+    else {
+        build(start, mid, depth + 1, threads, out, out_stats);
+        const uint32_t second_child = build(mid, end, depth + 1, threads, out, out_stats);
+        out[node_index].second_child_offset = second_child;
+        out[node_index].n_primitives = 0;
+        out[node_index].axis = static_cast<uint8_t>(axis);
     }
-    else{
-        // multiple axis have the same size, pick a random one
-        axis = random_int(0, 2);
+
+    for (int a = 0; a < 3; a++) {
+        out[node_index].bounds_min[a] = round_down(bounds.min()[a]);
+        out[node_index].bounds_max[a] = round_up(bounds.max()[a]);
     }
 
-    split_max(start, end, axis);
+    // SAH cost of the finished tree, relative to the root surface area (normalized in the constructor)
+    out_stats.sah_cost += bounds.surface_area() * (make_leaf ? sah_intersection_cost * object_span : sah_traversal_cost);
 
-    aabb box_left, box_right;
-    if (!left->bounding_box(box_left)
-        || !right->bounding_box(box_right))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    return node_index;
+}
+
+void bvh_build_stats::merge(const bvh_build_stats& other) {
+    sah_cost += other.sah_cost;
+    max_depth = std::max(max_depth, other.max_depth);
+    n_nodes += other.n_nodes;
+    n_leaves += other.n_leaves;
+    for (size_t i = 0; i < leaf_size_histogram.size(); i++)
+        leaf_size_histogram[i] += other.leaf_size_histogram[i];
+}
+
+void bvh_build_stats::print(std::ostream& out) const {
+    out << "BVH: " << n_nodes << " nodes, " << n_leaves << " leaves, depth " << max_depth
+        << ", SAH cost " << sah_cost << ", built in " << build_time_ms << "ms\n";
+    if (n_wide_nodes > 0)
+        out << "     collapsed into " << n_wide_nodes << " nodes of width " << BVH_WIDTH << "\n";
+    out << "     leaf sizes:";
+    for (size_t i = 1; i < leaf_size_histogram.size(); i++)
+        out << " " << i << ":" << leaf_size_histogram[i];
+    out << std::endl;
+}
+
+bvh_tree::bvh_tree(size_t object_span, const std::function<aabb(size_t)>& bounds_of, bvh_split_method method, int num_threads)
+    : split_method(method) {
+    const auto build_start = std::chrono::high_resolution_clock::now();
+    if (object_span == 0)
+        return;
+
+    num_threads = std::max(1, num_threads);
+    primitive_info.resize(object_span);
+    auto fetch_bounds = [this, &bounds_of](bvh_primitive_iterator chunk_start, bvh_primitive_iterator chunk_end) {
+        for (auto it = chunk_start; it < chunk_end; it++) {
+            const size_t i = it - primitive_info.begin();
+            const aabb objbox = bounds_of(i);
+            *it = { objbox, objbox.center(), i };
+        }
+        return true;
+    };
+    if (num_threads > 1 && object_span >= parallel_binning_threshold)
+        parallel_chunks(primitive_info.begin(), primitive_info.end(), num_threads, fetch_bounds);
+    else
+        fetch_bounds(primitive_info.begin(), primitive_info.end());
+
+    build(primitive_info.begin(), primitive_info.end(), 0, num_threads, nodes, stats);
+    nodes.shrink_to_fit();
+    stats.n_nodes = nodes.size();
+
+#if BVH_WIDTH > 2
+    if (nodes.front().is_leaf()) {
+        // A single leaf, the wide root gets it as its only child
+        wide_nodes.emplace_back();
+        for (int a = 0; a < 3; a++) {
+            wide_nodes[0].bounds[0][a][0] = nodes[0].bounds_min[a];
+            wide_nodes[0].bounds[1][a][0] = nodes[0].bounds_max[a];
+        }
+        wide_nodes[0].child[0] = nodes[0].primitives_offset;
+        wide_nodes[0].count[0] = nodes[0].n_primitives;
+    }
+    else {
+        wide_nodes.reserve(nodes.size() / (BVH_WIDTH - 1) + 1);
+        collapse(0);
+    }
+    wide_nodes.shrink_to_fit();
+    stats.n_wide_nodes = wide_nodes.size();
+    nodes.clear();
+    nodes.shrink_to_fit();
+#endif
+
+    // Remember the order of the primitives in the leaves, the owner reorders its primitives accordingly
+    primitive_order.reserve(object_span);
+    box = primitive_info.front().bounds;
+    for (const auto& info : primitive_info) {
+        primitive_order.push_back(static_cast<uint32_t>(info.index));
+        box = surrounding_box(box, info.bounds);
+    }
+    primitive_info.clear();
+    primitive_info.shrink_to_fit();
 
-    box = surrounding_box(box_left, box_right);
-}
\ No newline at end of file
+    stats.sah_cost /= box.surface_area();
+    stats.build_time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - build_start).count();
+}
+
+bvh_node::bvh_node(std::vector<shared_ptr<hittable>>::iterator start, std::vector<shared_ptr<hittable>>::iterator end, bvh_split_method method, int num_threads)
+    : tree(end - start, [start](size_t i) {
+            aabb objbox;
+            if (!start[i]->bounding_box(objbox))
+                std::cerr << "No bounding box in bvh_node constructor.\n";
+            return objbox;
+        }, method, num_threads) {
+    // Copy the primitives into the store in leaf order, so the per type arrays are traversed mostly sequentially
+    const auto order = tree.take_primitive_order();
+    primitives.reserve(order.size());
+    for (const uint32_t i : order)
+        primitives.push_back(store.add(start[i]));
+    store.shrink_to_fit();
+}
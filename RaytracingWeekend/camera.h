@@ -6,8 +6,8 @@ struct camera_settings {
     point3 lookfrom;
     point3 lookat;
 
-    double vfov = 20.;
-    double aperture = 0;
+    real vfov = 20.;
+    real aperture = 0;
 
     vec3 vup{ 0, 1, 0 };
 };
@@ -15,11 +15,12 @@ struct camera_settings {
 class camera {
 public:
     camera(point3 lookfrom, point3 lookat, vec3 vup,
-        double vfov, //vertical fov in degrees
-        double aperture,
-        double focus_dist,
-        const int horizontal_resolution
-        ) : image_width(horizontal_resolution), image_height(static_cast<int>(horizontal_resolution / aspect_ratio)), focus_dist(focus_dist)
+        real vfov, //vertical fov in degrees
+        real aperture,
+        real focus_dist,
+        const int horizontal_resolution,
+        const int vertical_resolution = 0 // 0 for the global aspect_ratio
+        ) : image_width(horizontal_resolution), image_height(vertical_resolution > 0 ? vertical_resolution : static_cast<int>(horizontal_resolution / aspect_ratio)), focus_dist(focus_dist)
      {
         //Camera orientation
         w = glm::normalize(lookfrom - lookat);
@@ -29,38 +30,41 @@ public:
         //Camera Projection Plane
         auto theta = glm::radians(vfov);
         auto h = tan(theta / 2);
-        const double viewport_height = 2.0*h;
-        const double viewport_width = viewport_height * aspect_ratio;
+        const real viewport_height = 2.0*h;
+        const real image_aspect = vertical_resolution > 0 ? real(horizontal_resolution) / real(vertical_resolution) : real(aspect_ratio);
+        const real viewport_width = viewport_height * image_aspect;
 
         lens_radius = aperture / 2;
 
         origin = lookfrom;
         horizontal = focus_dist*viewport_width * u;
         vertical = focus_dist*viewport_height * v;
-        left_corner = origin - horizontal / 2.0 - vertical / 2.0 - w * focus_dist;
+        left_corner = origin - horizontal / real(2) - vertical / real(2) - w * focus_dist;
 	}
 
-    camera(camera_settings sett, const int horizontal_resolution) : camera(
+    camera(camera_settings sett, const int horizontal_resolution, const int vertical_resolution = 0) : camera(
         sett.lookfrom,
         sett.lookat,
         sett.vup,
         sett.vfov,
         sett.aperture,
         glm::distance(sett.lookfrom, sett.lookat),
-        horizontal_resolution)
+        horizontal_resolution,
+        vertical_resolution)
     {}
 
     void move(vec3 movement) {
         origin += u * movement.x + v * movement.y + w * movement.z;
-        left_corner = origin - horizontal / 2.0 - vertical / 2.0 - w * focus_dist;
+        left_corner = origin - horizontal / real(2) - vertical / real(2) - w * focus_dist;
     }
 
-    ray get_ray(double s, double t) const {
-        vec3 rd = lens_radius * random_in_unit_disk();
+    // lens_sample is a uniform sample in [0,1)^2 for the point on the lens
+    ray get_ray(real s, real t, const vec2& lens_sample) const {
+        vec3 rd = lens_radius * sample_concentric_disk(lens_sample);
         vec3 offset = u * rd.x + v * rd.y;
         return ray(origin+offset, left_corner + horizontal * s + vertical * t - origin-offset, white_wavelength);
     }
-    ray get_mouse_ray(double s, double t) const {
+    ray get_mouse_ray(real s, real t) const {
         return ray(origin, left_corner + horizontal * s + vertical * t - origin, white_wavelength);
     }
 private:
@@ -68,8 +72,8 @@ private:
     vec3 horizontal;
     vec3 vertical;
     vec3 u, v, w;
-    double lens_radius;
-    double focus_dist;
+    real lens_radius;
+    real focus_dist;
     point3 left_corner;
 public:
     //Image
@@ -161,7 +161,8 @@ static unsigned short float_to_half(const float x) { // IEEE-754 16-bit floating
 	return (b & 0x80000000) >> 16 | (e > 112) * ((((e - 112) << 10) & 0x7C00) | m >> 13) | ((e < 113) & (e > 101)) * ((((0x007FF000 + m) >> (125 - e)) + 1) >> 1) | (e > 143) * 0x7FFF; // sign : normalized : denormalized : saturate
 }
 
-void write_exr_file(const char *filepath, const int width, const int height, const std::vector<color>& pixels) {
+// Returns false if the file couldn't be written
+bool write_exr_file(const char *filepath, const int width, const int height, const std::vector<color>& pixels) {
 	unsigned short *rgb = (unsigned short*)malloc(width * height * 3 * sizeof(unsigned short));
 	unsigned int ofs = 0;
 	const int i_max = pixels.size();
@@ -184,10 +185,17 @@ void write_exr_file(const char *filepath, const int width, const int height, con
 
 	std::cerr << "Writing EXR to file...  "<< std::endl;
 	FILE* f = fopen(filepath, "wb");
-	fwrite(exr, 1, exrSize, f);
-	fclose(f);
-	std::cerr << "Done!" << std::endl;
+	bool written = false;
+	if (f) {
+		written = fwrite(exr, 1, exrSize, f) == exrSize;
+		written = fclose(f) == 0 && written;
+	}
+	if (written)
+		std::cerr << "Done!" << std::endl;
+	else
+		std::cerr << "Couldn't write " << filepath << std::endl;
 	
 	free(rgb);
 	free(exr);
+	return written;
 }
\ No newline at end of file
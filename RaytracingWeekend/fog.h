@@ -5,19 +5,19 @@
 
 class fog :public hittable {
 public:
-	fog(shared_ptr<hittable> b, double density, color a):neg_inv_density(-1 / density), boundary(b), phase_function(std::make_shared<anisotropic>(a)) {
+	fog(shared_ptr<hittable> b, real density, color a):neg_inv_density(-1 / density), boundary(b), phase_function(std::make_shared<anisotropic>(a)) {
 	
 	}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 	virtual bool bounding_box(aabb& output_box) const override {return boundary->bounding_box(output_box);}
 public:
 	shared_ptr<hittable> boundary;
 	shared_ptr<material> phase_function;
-	double neg_inv_density;
+	real neg_inv_density;
 };
 
-bool fog::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool fog::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	hit_record rec_enter, rec_exit;
 
 
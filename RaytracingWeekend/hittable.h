@@ -7,9 +7,10 @@ class material;
 struct hit_record {
 	point3 p;
 	vec3 normal;
-	double t;
+	real t;
 	bool front_face;
 	material *mat_ptr;
+	int traversal_cost = 0; // number of visited BVH nodes, for debug views
 
 	inline void set_face_normal(const ray& r, const vec3& outward_normal) {
 		front_face = dot(r.direction(), outward_normal) < 0;
@@ -24,6 +25,18 @@ struct hit_record {
 
 class hittable {
 public:
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
 	virtual bool bounding_box(aabb& output_box) const = 0;
+	// Any hit query for shadow rays: is there an intersection in [t_min, t_max]? Shapes override it with a test
+	// that skips the hit_record, aggregates with one that stops at the first intersection instead of the closest.
+	virtual bool occluded(const ray& r, real t_min, real t_max) const {
+		hit_record rec;
+		return hit(r, t_min, t_max, rec);
+	}
+
+	// Light sampling, only implemented by the shapes that can be sampled as emitters (see light_list.h).
+	// random() returns a (not normalized) direction from origin towards a point on the shape, picked with the uniform
+	// sample u. pdf_value() is the solid angle density of sampling direction v that way, 0 if v misses the shape.
+	virtual real pdf_value(const point3& origin, const vec3& v) const { return 0; }
+	virtual vec3 random(const point3& origin, const vec2& u) const { return vec3(1, 0, 0); }
 };
\ No newline at end of file
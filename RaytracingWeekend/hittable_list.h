@@ -16,7 +16,8 @@ public:
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 	void add(hittable_list& list) { std::copy(list.begin(), list.end(), std::back_inserter(objects)); }
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 	virtual bool bounding_box(aabb& output_box) const override;
 
 protected:
@@ -44,10 +45,10 @@ bool hittable_list::bounding_box(aabb& output_box) const {
 	return true;
 }
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	hit_record tmp_rec;
 	bool hit_anything=false;
-	double closest_so_far = t_max;
+	real closest_so_far = t_max;
 
 	for (const auto& object : objects)
 	{
@@ -59,4 +60,11 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 	}
 
 	return hit_anything;
-}
\ No newline at end of file
+}
+
+bool hittable_list::occluded(const ray& r, real t_min, real t_max) const {
+	for (const auto& object : objects)
+		if (object->occluded(r, t_min, t_max))
+			return true;
+	return false;
+}
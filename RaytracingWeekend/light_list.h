@@ -0,0 +1,76 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "quad.h"
+#include "triangle.h"
+
+#include <vector>
+
+// The emitters of a scene that ray_color samples directly (next event estimation). Built once at scene load from
+// the top level objects: spheres, rects and triangles with an emissive material. Lights nested inside other
+// hittables (rotate_y, triangle_mesh, ...) are not sampled, but scattered rays still pick them up.
+class light_list {
+public:
+    light_list() = default;
+    light_list(hittable_list& scene) {
+        for (const auto& object : scene) {
+            const material* mat = emitter_material(object.get());
+            if (mat && (mat->type == material_type::emissive || mat->type == material_type::directional_light))
+                lights.push_back(object);
+        }
+        std::cerr << "Sampling " << lights.size() << " lights directly\n";
+    }
+
+    bool empty() const { return lights.empty(); }
+    size_t size() const { return lights.size(); }
+
+    // Picks one of the lights uniformly with the uniform number u, directions towards it are sampled with its random()
+    const hittable& pick(double u) const {
+        return *lights[std::min(static_cast<size_t>(u * lights.size()), lights.size() - 1)];
+    }
+
+    // Density of sampling direction v from origin towards light (picked by pick())
+    real pdf_value(const hittable& light, const point3& origin, const vec3& v) const {
+        return light.pdf_value(origin, v) / static_cast<real>(lights.size());
+    }
+
+    // Density of the light sampling reaching the emitter that a ray from origin along v hit first at distance t, 0 if that
+    // emitter isn't one of the lights. Only the closest light along v counts, the shadow rays treat the others as occluded.
+    real pdf_value(const point3& origin, const vec3& v, real t) const {
+        const ray r(origin, v, white_wavelength);
+        const hittable* closest = nullptr;
+        real closest_t = infinity;
+        hit_record rec;
+        for (const auto& light : lights) {
+            if (light->hit(r, global_t_min, closest_t, rec)) {
+                closest = light.get();
+                closest_t = rec.t;
+            }
+        }
+        if (!closest || std::fabs(closest_t - t) > t * real(1e-3))
+            return 0;
+        return pdf_value(*closest, origin, v);
+    }
+
+private:
+    // Only called while building, the dynamic_casts are not on the hot path
+    static const material* emitter_material(const hittable* object) {
+        if (auto p = dynamic_cast<const sphere*>(object)) return p->mat_ptr.get();
+        if (auto p = dynamic_cast<const triangle*>(object)) return p->mat_ptr.get();
+        if (auto p = dynamic_cast<const xy_rect*>(object)) return p->mat_ptr.get();
+        if (auto p = dynamic_cast<const xz_rect*>(object)) return p->mat_ptr.get();
+        if (auto p = dynamic_cast<const yz_rect*>(object)) return p->mat_ptr.get();
+        return nullptr;
+    }
+
+    std::vector<shared_ptr<hittable>> lights;
+};
+
+// Power heuristic (beta = 2) weight of a sample taken with pdf_a, when pdf_b could have produced it as well
+inline real power_heuristic(real pdf_a, real pdf_b) {
+    const real a2 = pdf_a * pdf_a;
+    const real b2 = pdf_b * pdf_b;
+    return a2 / (a2 + b2);
+}
@@ -1,27 +1,101 @@
 #pragma once
 #include "rtweekend.h"
 #include "hittable.h"
+#include "onb.h"
+
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <vector>
 
 struct hit_record;
 
+enum class material_type : uint8_t {
+	lambertian,
+	directional_light,
+	emissive,
+	metal,
+	anisotropic,
+	specular,
+	dielectric,
+	thinfilm,
+	normal
+};
+
+// Properties the integrator branches on. They are fixed per material type and set by its constructor,
+// so ray_color only has to test a bit instead of doing RTTI lookups or calling virtual functions that do nothing.
+enum material_flags : uint8_t {
+	material_scatters = 1 << 0,      // sample() can return true
+	material_emissive = 1 << 1,      // emitted() can be non zero
+	material_specular = 1 << 2,      // scattering is (close to) a single direction
+	material_transmissive = 1 << 3,  // rays can pass through the surface
+	material_dispersive = 1 << 4,    // the result depends on the wavelength of the ray
+	material_diffuse = 1 << 5        // eval() and pdf() describe the scattering, so light sampling can be combined with it
+};
+
+// A direction sampled by material::sample(). f is the brdf times the cosine term and pdf the density wo was sampled
+// with, the path throughput gets multiplied by f / pdf. For specular samples only that ratio is known: mirrors and glass,
+// but also the other materials whose directions can't be evaluated with eval() and pdf().
+struct bsdf_sample {
+	vec3 wo;
+	color f;
+	real pdf = 0;
+	bool specular = false;
+};
+
 class material {
 public:
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+	material(material_type type, uint8_t flags) : type(type), flags(flags) {}
+
+	// Samples the scattered direction of r_in from the uniform numbers u, returns false if the ray is absorbed. Most
+	// materials sample a direction from u.x and u.y, u.z is for the ones that need a third dimension.
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const = 0;
+	// brdf times cosine and sampling density of scattering r_in into wo, only implemented for material_diffuse
+	virtual color eval(const ray& r_in, const hit_record& rec, const vec3& wo) const { return color(0, 0, 0); }
+	virtual real pdf(const ray& r_in, const hit_record& rec, const vec3& wo) const { return 0; }
 	virtual color emitted(const ray& r_in, const hit_record& rec) const {return color(0, 0, 0);}
+
+	bool has_scatter() const { return flags & material_scatters; }
+	bool is_emissive() const { return flags & material_emissive; }
+	bool is_specular() const { return flags & material_specular; }
+	bool is_transmissive() const { return flags & material_transmissive; }
+	bool is_dispersive() const { return flags & material_dispersive; }
+	bool is_diffuse() const { return flags & material_diffuse; }
+
+	const material_type type;
+	const uint8_t flags;
 };
 
+// Cosine weighted sampling around the normal, shared by the lambertian style materials. The brdf is albedo / pi,
+// so f / pdf is just the albedo.
+inline bool sample_lambertian(const hit_record& rec, const color& albedo, const vec3& u, bsdf_sample& s) {
+	const vec3 local = sample_cosine_hemisphere(vec2(u.x, u.y));
+	s.wo = onb(rec.normal).local(local);
+	s.pdf = cosine_hemisphere_pdf(local.z);
+	s.f = albedo * s.pdf;
+	s.specular = false;
+	return s.pdf > 0;
+}
+
+inline real lambertian_pdf(const hit_record& rec, const vec3& wo) {
+	return cosine_hemisphere_pdf(dot(rec.normal, glm::normalize(wo)));
+}
+
 class lambertian : public material {
 public:
-	lambertian(const color& a): albedo(a){}
+	lambertian(const color& a): material(material_type::lambertian, material_scatters | material_diffuse), albedo(a){}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override{
-		auto scatter_direction = rec.normal + random_unit_vector();
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
+		return sample_lambertian(rec, albedo, u, s);
+	}
 
-		if (glm::all(glm::epsilonEqual(scatter_direction, vec3(0,0,0), global_t_min))) scatter_direction = rec.normal;
+	virtual color eval(const ray& r_in, const hit_record& rec, const vec3& wo) const override {
+		return albedo * lambertian_pdf(rec, wo);
+	}
 
-		scattered = ray(rec.p, scatter_direction, r_in.lambda());
-		attenuation *= albedo;
-		return true;
+	virtual real pdf(const ray& r_in, const hit_record& rec, const vec3& wo) const override {
+		return lambertian_pdf(rec, wo);
 	}
 
 private:
@@ -31,15 +105,18 @@ private:
 
 class directional_light : public material {
 public:
-	directional_light(color c, double angle) : emit(c), max_scalar_product(-std::cos(glm::radians(angle))), albedo(color(1,1,1)) {}
+	directional_light(color c, double angle) : material(material_type::directional_light, material_scatters | material_emissive | material_diffuse), emit(c), max_scalar_product(-std::cos(glm::radians(angle))), albedo(color(1,1,1)) {}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-		auto scatter_direction = rec.normal + random_unit_vector();
-		if (glm::all(glm::epsilonEqual(scatter_direction, vec3(0, 0, 0), global_t_min))) scatter_direction = rec.normal;
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
+		return sample_lambertian(rec, albedo, u, s);
+	}
 
-		scattered = ray(rec.p, scatter_direction, r_in.lambda());
-		attenuation *= albedo;
-		return true;
+	virtual color eval(const ray& r_in, const hit_record& rec, const vec3& wo) const override {
+		return albedo * lambertian_pdf(rec, wo);
+	}
+
+	virtual real pdf(const ray& r_in, const hit_record& rec, const vec3& wo) const override {
+		return lambertian_pdf(rec, wo);
 	}
 
 	virtual color emitted(const ray& r_in, const hit_record& rec) const override {
@@ -59,9 +136,9 @@ private:
 
 class emissive : public material {
 public:
-	emissive(color c) : emit(c) {}
+	emissive(color c) : material(material_type::emissive, material_emissive), emit(c) {}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
 		return false;
 	}
 
@@ -75,51 +152,56 @@ public:
 
 class metal : public material {
 public:
-	metal(const color & a, double f): albedo(a), fuzz(f< 1? f:1){}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+	metal(const color & a, double f): material(material_type::metal, material_scatters | material_specular), albedo(a), fuzz(f< 1? f:1){}
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
 		vec3 reflected = reflect(glm::normalize(r_in.direction()), rec.normal);
-		scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.lambda());
-		attenuation *= albedo;
-		return dot(scattered.direction(), rec.normal) > 0;
+		// Perturbed by a point in the ball of radius fuzz, u.x and u.y pick the direction and u.z the cube root distributed radius
+		s.wo = reflected + fuzz * real(std::cbrt(u.z)) * sample_uniform_sphere(vec2(u.x, u.y));
+		s.f = albedo;
+		s.pdf = 1;
+		s.specular = true;
+		return dot(s.wo, rec.normal) > 0;
 	}
 	color albedo;
-	double fuzz;
+	real fuzz;
 };
 
 class anisotropic : public material {
 //useful for smoke and stuff, interesting material 
 public:
-	anisotropic(color a) : albedo(a), anisotropy(0) {}
-	anisotropic(color a, double anisotropy) : albedo(a), anisotropy(anisotropy) {}
+	anisotropic(color a) : material(material_type::anisotropic, material_scatters), albedo(a), anisotropy(0) {}
+	anisotropic(color a, double anisotropy) : material(material_type::anisotropic, material_scatters), albedo(a), anisotropy(anisotropy) {}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-		auto direction = random_in_unit_sphere() + normalize(r_in.direction()) * anisotropy;
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
+		auto direction = sample_uniform_sphere(vec2(u.x, u.y)) * real(std::cbrt(u.z)) + normalize(r_in.direction()) * anisotropy;
 		if (glm::all(glm::epsilonEqual(direction, vec3(0, 0, 0), global_t_min))) direction = rec.normal;
-		scattered = ray(rec.p, direction, r_in.lambda());
-		attenuation *= albedo;
+		s.wo = direction;
+		s.f = albedo;
+		s.pdf = 1;
+		s.specular = true; // no closed form pdf
 		return true;
 	}
 
 public:
 	color albedo;
-	double anisotropy;
+	real anisotropy;
 };
 
 
 class specular : public material {
 public:
-	specular(const color& a, double f) : albedo(a), fuzz(f) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-		vec3 scatter_direction;
-		if (random_double() < fuzz) {
-			scatter_direction = rec.normal + random_unit_vector();
-			if (glm::all(glm::epsilonEqual(scatter_direction, vec3(0,0,0), global_t_min))) scatter_direction = rec.normal;
-		}
+	specular(const color& a, double f) : material(material_type::specular, material_scatters | material_specular), albedo(a), fuzz(f) {}
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
+		// A fuzz fraction of the rays is scattered diffusely, the rest is mirrored. The mixture is treated as specular.
+		// u.x / fuzz is uniform again once u.x < fuzz.
+		if (u.x < fuzz)
+			s.wo = onb(rec.normal).local(sample_cosine_hemisphere(vec2(u.x / fuzz, u.y)));
 		else
-			scatter_direction  = glm::reflect(glm::normalize(r_in.direction()), rec.normal);
-		scattered = ray(rec.p, scatter_direction, r_in.lambda());
-		attenuation *= albedo;
-		return dot(scattered.direction(), rec.normal) > 0;
+			s.wo = glm::reflect(glm::normalize(r_in.direction()), rec.normal);
+		s.f = albedo;
+		s.pdf = 1;
+		s.specular = true;
+		return dot(s.wo, rec.normal) > 0;
 	}
 	color albedo;
 	double fuzz;
@@ -127,9 +209,10 @@ public:
 
 class dielectric : public material {
 public:
-	dielectric(double refractive_index) : albedo(color(1,1,1)), ri(refractive_index), blur(0.), dispersion(0.044 * 1e3) {}
-	dielectric(const color& a, double refractive_index, double blur = 0., double disp = 0.044 * 1e3) : albedo(a), ri(refractive_index), blur(blur), dispersion(disp) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+	dielectric(double refractive_index) : dielectric(color(1,1,1), refractive_index) {}
+	dielectric(const color& a, double refractive_index, double blur = 0., double disp = 0.044 * 1e3)
+		: material(material_type::dielectric, material_scatters | material_specular | material_transmissive | material_dispersive), albedo(a), ri(refractive_index), blur(blur), dispersion(disp) {}
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
 
 		#ifdef DISPERSION
 		const double r_index = ri_at_lambda(ri, dispersion, r_in.lambda());
@@ -137,7 +220,7 @@ public:
 		const double r_index = ri;
 		#endif
 
-		const double refraction_ratio = rec.front_face ? (1. / r_index) : r_index;
+		const real refraction_ratio = rec.front_face ? (1. / r_index) : r_index;
 
 		const auto in_vec = glm::normalize(r_in.direction());
 		const auto cos_theta = fmin(dot(-in_vec, rec.normal), 1.);
@@ -145,29 +228,33 @@ public:
 
 		const bool cannot_refract = refraction_ratio * sin_theta > 1.;
 		vec3 direction;
-		if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double()) {
+		if (cannot_refract || reflectance(cos_theta, refraction_ratio) > u.x) {
 			direction = reflect(in_vec, rec.normal);
 		}
 		else {
 			direction = refract(in_vec, rec.normal, refraction_ratio);
-			direction += random_dir() * blur;
+			// u.x picked between reflection and refraction, the blur uses the other two dimensions
+			direction += sample_uniform_sphere(vec2(u.y, u.z)) * blur;
 		}
 
 #ifdef LAMBERT_BEER
+		s.f = color(1, 1, 1);
 		if (!rec.front_face) {
 			// We hit a backface (the ray must have travelled through the object)
 			auto ray_length = glm::distance(r_in.origin(), rec.p);
-			attenuation *= exp(-ray_length * (color(1)-albedo));
+			s.f = exp(-ray_length * (color(1)-albedo));
 		}
 #else
-		attenuation *= albedo;
+		s.f = albedo;
 #endif
-		scattered = ray(rec.p, direction, r_in.lambda());
+		s.wo = direction;
+		s.pdf = 1;
+		s.specular = true;
 		return true;
 	}
 	color albedo;
 	double ri; // refractive index
-	double blur;
+	real blur;
 	double dispersion; // dispersion coefficient in nanometers
 private:
 	inline double fastpow5(double input) const {
@@ -191,94 +278,184 @@ private:
 class thinfilm : public material {
 // More general metal AND thinfilm material (can be used for dielectrics too)
 // https://blenderartists.org/t/pbr-metal-shader-with-accurate-fresnel-based-on-complex-refractive-index-script/672025
+// The transmittance only depends on the incident cosine and the wavelength, so by default it is tabulated over both on
+// first use (shared by all threads) and interpolated bilinearly. Films stacked through underlying get their own tables.
 
 
 public:
-	thinfilm(const color& a, double t, double n, const shared_ptr<material> underlying = nullptr) : albedo(a), thickness(t), n0(1), n1(n), n2(1), underlying(underlying) {
-		auto innerDielectric = dynamic_cast<dielectric*>(underlying.get());
-		if (innerDielectric != nullptr)
-			n2 = innerDielectric->ri;
-		else {
-			auto innerThinfilm = dynamic_cast<thinfilm*>(underlying.get());
-			if (innerThinfilm != nullptr) {
-				n2 = innerThinfilm->n1;
-				innerThinfilm->n0 = n1;
+	thinfilm(const color& a, double t, double n, const shared_ptr<material> underlying = nullptr, bool use_table = true)
+		: material(material_type::thinfilm, material_scatters | material_specular | material_transmissive | material_dispersive), albedo(a), thickness(t), n0(1), n1(n), n2(1), underlying(underlying), use_table(use_table) {
+		if (underlying == nullptr)
+			return;
+		if (underlying->type == material_type::dielectric)
+			n2 = static_cast<dielectric*>(underlying.get())->ri;
+		else if (underlying->type == material_type::thinfilm) {
+			auto innerThinfilm = static_cast<thinfilm*>(underlying.get());
+			n2 = innerThinfilm->n1;
+			innerThinfilm->n0 = n1;
+		}
+	}
+	virtual bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
+		const double cos0 = std::min(glm::abs(dot(glm::normalize(r_in.direction()), rec.normal)), real(1));
+		const double t = use_table ? table_transmittance(cos0, r_in.lambda()) : transmittance(cos0, r_in.lambda());
+
+		if (u.x < t) 
+		{
+			auto scatterRes = true;
+			if(underlying == nullptr)
+			{
+				// transmission through air
+				s.wo = r_in.direction();
+				s.f = albedo;
+				s.pdf = 1;
+				s.specular = true;
 			}
+			else {
+				// transmission using the underlying material, u.x / t is uniform again once u.x < t
+				scatterRes = underlying->sample(r_in, rec, vec3(u.x / t, u.y, u.z), s);
+				s.f *= albedo;
+			}
+			return scatterRes;
+		}
+		else
+		{ //reflection
+			s.wo = reflect(glm::normalize(r_in.direction()), rec.normal);
+			s.f = albedo;
+			s.pdf = 1;
+			s.specular = true;
+			return true;
 		}
 	}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {		
-		const double cos0 = glm::abs(dot(r_in.direction(), rec.normal));
 
+	// Transmitted intensity at the incident cosine cos0 and the wavelength, the rest of the light is reflected
+	double transmittance(double cos0, double lambda) const {
 		// compute the phase change term (constant)
 		double d10 = (n1 > n0) ? 0 : pi;
 		double d12 = (n1 > n2) ? 0 : pi;
 		double delta = d10 + d12;
 
-		double t=0; // transmitted light
-
 		// now, compute cos1, the cosine of the reflected angle
 		double sin1 = pow(n0 / n1, 2) * (1 - cos0 * cos0);
 		double sin2 = pow(n0 / n2, 2) * (1 - cos0 * cos0);
 
-		if (sin1 > 1 || sin2 > 1) t = 1; // total internal reflection
-		else {
-			double cos1 = sqrt(1 - sin1);
+		if (sin1 > 1 || sin2 > 1) return 1; // total internal reflection
 
-			// compute cos2, the cosine of the final transmitted angle, i.e. cos(theta_2)
-			// we need this angle for the Fresnel terms at the bottom interface
-			double cos2 = sqrt(1 - sin2);
+		double cos1 = sqrt(1 - sin1);
 
-			// get the reflection transmission amplitude Fresnel coefficients
-			double alpha_s = rs(n1, n0, cos1, cos0) * rs(n1, n2, cos1, cos2); // rho_10 * rho_12 (s-polarized)
-			double alpha_p = rp(n1, n0, cos1, cos0) * rp(n1, n2, cos1, cos2); // rho_10 * rho_12 (p-polarized)
+		// compute cos2, the cosine of the final transmitted angle, i.e. cos(theta_2)
+		// we need this angle for the Fresnel terms at the bottom interface
+		double cos2 = sqrt(1 - sin2);
 
-			double beta_s = ts(n0, n1, cos0, cos1) * ts(n1, n2, cos1, cos2); // tau_01 * tau_12 (s-polarized)
-			double beta_p = tp(n0, n1, cos0, cos1) * tp(n1, n2, cos1, cos2); // tau_01 * tau_12 (p-polarized)
+		// get the reflection transmission amplitude Fresnel coefficients
+		double alpha_s = rs(n1, n0, cos1, cos0) * rs(n1, n2, cos1, cos2); // rho_10 * rho_12 (s-polarized)
+		double alpha_p = rp(n1, n0, cos1, cos0) * rp(n1, n2, cos1, cos2); // rho_10 * rho_12 (p-polarized)
 
-			// compute the phase term (phi)
-			double phi = (2 * pi / r_in.lambda()) * (2 * n1 * thickness * cos1) + delta;
+		double beta_s = ts(n0, n1, cos0, cos1) * ts(n1, n2, cos1, cos2); // tau_01 * tau_12 (s-polarized)
+		double beta_p = tp(n0, n1, cos0, cos1) * tp(n1, n2, cos1, cos2); // tau_01 * tau_12 (p-polarized)
 
-			// finally, evaluate the transmitted intensity for the two possible polarizations
-			double ts = beta_s*beta_s / (alpha_s*alpha_s - 2 * alpha_s * cos(phi) + 1);
-			double tp = beta_p*beta_p / (alpha_p*alpha_p - 2 * alpha_p * cos(phi) + 1);
+		// compute the phase term (phi)
+		double phi = (2 * pi / lambda) * (2 * n1 * thickness * cos1) + delta;
 
-			// we need to take into account conservation of energy for transmission
-			double beamRatio = (n2 * cos2) / (n0 * cos0);
+		// finally, evaluate the transmitted intensity for the two possible polarizations
+		double ts = beta_s*beta_s / (alpha_s*alpha_s - 2 * alpha_s * cos(phi) + 1);
+		double tp = beta_p*beta_p / (alpha_p*alpha_p - 2 * alpha_p * cos(phi) + 1);
 
-			// calculate the average transmitted intensity (if you know the polarization distribution of your
-			// light source, you should specify it here. if you don't, a 50%/50% average is generally used)
-			t = beamRatio * (ts + tp) / 2;
-		}
+		// we need to take into account conservation of energy for transmission
+		double beamRatio = (n2 * cos2) / (n0 * cos0);
 
-		if (random_double() < t) 
-		{
-			auto scatterRes = true;
-			if(underlying == nullptr)
-			{
-				// transmission through air
-				attenuation *= albedo;
-				scattered = ray(rec.p, r_in.direction(), r_in.lambda());
-			}
-			else {
-				// transmission using the underlying material
-				auto scatterRes = underlying->scatter(r_in, rec, attenuation, scattered); 
-				attenuation *= albedo;
-			}
-			return scatterRes;
-		}
-		else
-		{ //reflection
-			vec3 reflected = reflect(glm::normalize(r_in.direction()), rec.normal);
-			scattered = ray(rec.p, reflected, r_in.lambda());
-			attenuation *= albedo;
-			return true;
-		}
+		// calculate the average transmitted intensity (if you know the polarization distribution of your
+		// light source, you should specify it here. if you don't, a 50%/50% average is generally used)
+		return beamRatio * (ts + tp) / 2;
 	}
+
+	// transmittance() from the table, built on the first call. Outside of it (total internal reflection, close to grazing
+	// and wavelengths beyond the CIE range) the exact value is returned.
+	double table_transmittance(double cos0, double lambda) const {
+		std::call_once(table_built, [this] { build_table(); });
+		if (cos0 < exact_below || lambda < lambda_start || lambda > lambda_end)
+			return transmittance(cos0, lambda);
+
+		return interpolate_table(std::min((cos0 - table_cos_min) * cos_scale, cos_count - 1.),
+		                         std::min((lambda - lambda_start) * lambda_scale, lambda_count - 1.));
+	}
+
+	// Largest difference between table_transmittance() and transmittance() at the cell centers, set once the table is built
+	double table_error() const { return max_table_error; }
+
+	static constexpr double table_tolerance = 1e-3;
+
 private:
 	color albedo;
 	double thickness;
 	double n0, n1, n2;
 	const shared_ptr<material> underlying;
+	const bool use_table;
+
+	// Table of transmittance() over [table_cos_min, 1] x [lambda_start, lambda_end], the cosine varies fastest. The
+	// resolution keeps the phase of the interference below pi/32 per cell, the total internal reflection range is left out.
+	// Towards grazing angles the interference peaks get too narrow for it, below exact_below the table isn't used.
+	mutable std::once_flag table_built;
+	mutable std::vector<float> table;
+	mutable int cos_count = 0, lambda_count = 0;
+	mutable double table_cos_min = 0, cos_scale = 0, lambda_scale = 0;
+	mutable double exact_below = 2;
+	mutable double max_table_error = 0;
+
+	void build_table() const {
+		// Below this incident cosine one of the refracted angles doesn't exist (n0 is larger than n1 or n2)
+		const double n_min = std::min(n1, n2);
+		table_cos_min = n0 > n_min ? std::sqrt(1 - (n_min / n0) * (n_min / n0)) : 0;
+
+		// The phase 4 pi n1 d cos1 / lambda changes fastest at the shortest wavelength
+		const double max_phase_step = pi / 32;
+		const double phase_range = 4 * pi * n1 * thickness / lambda_start;
+		cos_count = std::clamp(static_cast<int>(std::ceil(phase_range / max_phase_step)) + 1, 16, 1024);
+		lambda_count = std::clamp(static_cast<int>(std::ceil(phase_range / lambda_start * (lambda_end - lambda_start) / max_phase_step)) + 1, 16, 1024);
+		cos_scale = (cos_count - 1) / (1 - table_cos_min);
+		lambda_scale = (lambda_count - 1) / (lambda_end - lambda_start);
+
+		// The grazing end is evaluated just inside, at cos0 = 0 the beam ratio is 0 / 0
+		auto cos_at = [&](double x) { return std::max(table_cos_min + x / cos_scale, 1e-6); };
+		auto lambda_at = [&](double y) { return lambda_start + y / lambda_scale; };
+
+		table.resize(static_cast<size_t>(cos_count) * lambda_count);
+		for (int j = 0; j < lambda_count; j++)
+			for (int i = 0; i < cos_count; i++)
+				table[static_cast<size_t>(j) * cos_count + i] = static_cast<float>(transmittance(cos_at(i), lambda_at(j)));
+
+		// The bilinear interpolation is furthest off in the middle of the cells. The table is used from the first cosine
+		// on where all cells stay within table_tolerance.
+		std::vector<double> column_error(cos_count - 1, 0.);
+		for (int j = 0; j + 1 < lambda_count; j++)
+			for (int i = 0; i + 1 < cos_count; i++) {
+				const double error = interpolate_table(i + .5, j + .5) - transmittance(cos_at(i + .5), lambda_at(j + .5));
+				column_error[i] = std::max(column_error[i], std::abs(error));
+			}
+		int first = cos_count - 1;
+		while (first > 0 && column_error[first - 1] <= table_tolerance)
+			first--;
+		for (int i = first; i + 1 < cos_count; i++)
+			max_table_error = std::max(max_table_error, column_error[i]);
+		exact_below = first + 1 < cos_count ? table_cos_min + first / cos_scale : 2;
+		// Built during the render by a worker thread: formatted on its own, so it neither inherits the flags of std::cerr
+		// nor gets split by other output, and written on a new line below the progress report
+		std::ostringstream report;
+		report << std::defaultfloat << std::setprecision(3) << "\nThin film table: " << cos_count << "x" << lambda_count
+		       << " samples, exact below cos " << exact_below << ", max error " << std::scientific << max_table_error << "\n";
+		std::cerr << report.str() << std::flush;
+	}
+
+	// Bilinear interpolation at the continuous table position (x along the cosines, y along the wavelengths)
+	double interpolate_table(double x, double y) const {
+		const int i = std::min(static_cast<int>(x), cos_count - 2);
+		const int j = std::min(static_cast<int>(y), lambda_count - 2);
+		const double fx = x - i, fy = y - j;
+		const float* row = &table[static_cast<size_t>(j) * cos_count + i];
+		const double a = row[0] + (row[1] - row[0]) * fx;
+		const double b = row[cos_count] + (row[cos_count + 1] - row[cos_count]) * fx;
+		return a + (b - a) * fy;
+	}
+
 	double rs(double n1, double n2, double cosI, double cosT) const {
 		return (n1 * cosI - n2 * cosT) / (n1 * cosI + n2 * cosT);
 	}
@@ -301,10 +478,10 @@ private:
 
 class normal :public material {
 private:
-	double brightness, saturation;
+	real brightness, saturation;
 public:
-	normal(double saturation=1):saturation(saturation), brightness(0.5){}
-	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+	normal(double saturation=1): material(material_type::normal, material_emissive), saturation(saturation), brightness(0.5){}
+	bool sample(const ray& r_in, const hit_record& rec, const vec3& u, bsdf_sample& s) const override {
 		return false;
 	}
 	color emitted(const ray& r_in, const hit_record& rec) const override {
@@ -312,6 +489,6 @@ public:
 		if(rec.front_face)
 			return (saturation * rec.normal) + vec3(brightness);
 		else
-			return (.2 * saturation * rec.normal) + vec3(.2);
+			return (real(.2) * saturation * rec.normal) + vec3(.2);
 	}
 };
\ No newline at end of file
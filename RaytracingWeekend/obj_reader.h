@@ -3,21 +3,20 @@
 #include <fstream>      // std::ifstream
 #include <regex>
 #include "rtweekend.h"
-#include "triangle.h"
+#include "triangle_mesh.h"
 #include "hittable.h"
 #include "hittable_list.h"
 
-hittable_list obj(std::string filename, std::shared_ptr<material> mat) {
-    std::vector< unsigned int > vertexIndices, normalIndices;
+// Loads the triangles of an obj file into a single indexed mesh, the faces must contain normals
+shared_ptr<triangle_mesh> obj(std::string filename, std::shared_ptr<material> mat) {
+    std::vector< uint32_t > vertexIndices, normalIndices;
     std::vector< vec3 > temp_vertices;
     std::vector< vec3 > temp_normals;
 
-    hittable_list my_tris;
-
     std::ifstream file{ filename, std::ifstream::in };
     if (!file.is_open()) {
         std::cerr << "Couldn't open the file: " << filename << std::endl;
-        return my_tris;
+        return make_shared<triangle_mesh>();
     }
 
     std::string lineHeader;
@@ -29,7 +28,7 @@ hittable_list obj(std::string filename, std::shared_ptr<material> mat) {
             temp_vertices.push_back(vertex);
         }
         else if (lineHeader == "vn") {
-            // read the normals (currently not in use)
+            // read the normals (only the first normal of a face is used, as flat shading normal)
             vec3 normal;
             file >> normal[0] >> normal[1] >> normal[2];
             temp_normals.push_back(normal);
@@ -48,25 +47,19 @@ hittable_list obj(std::string filename, std::shared_ptr<material> mat) {
                 matches = sscanf(strBuffer.c_str(), "%d//%d %d//%d %d//%d\n", &vertexIndex[0], &normalIndex[0], &vertexIndex[1], &normalIndex[1], &vertexIndex[2], &normalIndex[2]);
                 if (matches != 6) {
                     std::cerr << "Parser couldn't read the file contents." << std::endl;
-                    return my_tris;
+                    break;
                 }
             }
 
-            vertexIndices.push_back(vertexIndex[0]);
-            vertexIndices.push_back(vertexIndex[1]);
-            vertexIndices.push_back(vertexIndex[2]);
-            normalIndices.push_back(normalIndex[0]);
-            normalIndices.push_back(normalIndex[1]);
-            normalIndices.push_back(normalIndex[2]);
-
-            my_tris.add(make_shared<triangle>(
-                temp_vertices[vertexIndex[0] - 1], 
-                temp_vertices[vertexIndex[1] - 1], 
-                temp_vertices[vertexIndex[2] - 1], 
-                temp_normals[normalIndex[0]-1],
-                mat));
+            // obj indices start at 1
+            vertexIndices.push_back(vertexIndex[0] - 1);
+            vertexIndices.push_back(vertexIndex[1] - 1);
+            vertexIndices.push_back(vertexIndex[2] - 1);
+            normalIndices.push_back(normalIndex[0] - 1);
         }
     }
-    std::cerr << "Loaded "<<filename<<" with "<< normalIndices.size() << " normals and " << vertexIndices.size()<< " vertecies" << std::endl;
-    return my_tris;
+
+    auto mesh = make_shared<triangle_mesh>(std::move(temp_vertices), std::move(vertexIndices), std::move(temp_normals), std::move(normalIndices), mat);
+    std::cerr << "Loaded " << filename << " with " << mesh->triangle_count() << " triangles (" << mesh->memory_usage() / 1024 << " KiB)" << std::endl;
+    return mesh;
 }
\ No newline at end of file
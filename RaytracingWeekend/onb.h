@@ -0,0 +1,19 @@
+#pragma once
+#include "rtweekend.h"
+
+// Orthonormal basis around w, for turning directions sampled around the z axis into world space
+class onb {
+public:
+    onb(const vec3& n) {
+        w = glm::normalize(n);
+        const vec3 a = (std::fabs(w.x) > real(0.9)) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        v = glm::normalize(cross(w, a));
+        u = cross(w, v);
+    }
+
+    vec3 local(real a, real b, real c) const { return a * u + b * v + c * w; }
+    vec3 local(const vec3& a) const { return local(a.x, a.y, a.z); }
+
+public:
+    vec3 u, v, w;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+//https://www.w3.org/TR/png/
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+// Writes 8 bit RGB PNGs without zlib: the image data goes into stored (uncompressed) deflate blocks, so the files are
+// as large as the raw pixels but need nothing but the standard library.
+
+constexpr std::array<uint32_t, 256> png_crc_table = [] {
+	std::array<uint32_t, 256> table{};
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		table[n] = c;
+	}
+	return table;
+}();
+
+inline void png_put_u32(std::vector<unsigned char>& out, uint32_t v) {
+	out.push_back(static_cast<unsigned char>(v >> 24));
+	out.push_back(static_cast<unsigned char>(v >> 16));
+	out.push_back(static_cast<unsigned char>(v >> 8));
+	out.push_back(static_cast<unsigned char>(v));
+}
+
+// Length, type, data and the CRC over type and data
+inline void png_put_chunk(std::vector<unsigned char>& out, const char* type, const std::vector<unsigned char>& data) {
+	png_put_u32(out, static_cast<uint32_t>(data.size()));
+	const size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	uint32_t crc = 0xffffffffu;
+	for (size_t i = start; i < out.size(); i++)
+		crc = png_crc_table[(crc ^ out[i]) & 0xff] ^ (crc >> 8);
+	png_put_u32(out, crc ^ 0xffffffffu);
+}
+
+// Same orientation and gamma (2) as the preview window, pixels are stored bottom up and right to left
+bool write_png_file(const char* filepath, const int width, const int height, const std::vector<color>& pixels) {
+	// Every scanline starts with filter type 0 (none)
+	std::vector<unsigned char> raw;
+	raw.reserve(static_cast<size_t>(width * 3 + 1) * height);
+	const size_t i_max = pixels.size();
+	for (int y = 0; y < height; y++) {
+		raw.push_back(0);
+		for (int x = 0; x < width; x++) {
+			const color& c = pixels[i_max - (static_cast<size_t>(y) * width + x) - 1];
+			raw.push_back(static_cast<unsigned char>(255.999 * clamp(sqrt(c.x))));
+			raw.push_back(static_cast<unsigned char>(255.999 * clamp(sqrt(c.y))));
+			raw.push_back(static_cast<unsigned char>(255.999 * clamp(sqrt(c.z))));
+		}
+	}
+
+	// zlib stream of stored blocks of at most 65535 bytes, followed by the Adler-32 of the raw data
+	std::vector<unsigned char> zlib = { 0x78, 0x01 };
+	size_t pos = 0;
+	do {
+		const size_t len = std::min<size_t>(raw.size() - pos, 65535);
+		zlib.push_back(pos + len == raw.size() ? 1 : 0); // final block flag, block type 00
+		zlib.push_back(static_cast<unsigned char>(len));
+		zlib.push_back(static_cast<unsigned char>(len >> 8));
+		zlib.push_back(static_cast<unsigned char>(~len));
+		zlib.push_back(static_cast<unsigned char>(~len >> 8));
+		zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+		pos += len;
+	} while (pos < raw.size());
+	uint32_t a = 1, b = 0;
+	for (const unsigned char byte : raw) {
+		a = (a + byte) % 65521;
+		b = (b + a) % 65521;
+	}
+	png_put_u32(zlib, (b << 16) | a);
+
+	std::vector<unsigned char> header;
+	png_put_u32(header, width);
+	png_put_u32(header, height);
+	header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8 bit RGB, deflate, adaptive filtering, no interlacing
+
+	std::vector<unsigned char> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	png_put_chunk(png, "IHDR", header);
+	png_put_chunk(png, "IDAT", zlib);
+	png_put_chunk(png, "IEND", {});
+
+	FILE* f = fopen(filepath, "wb");
+	if (!f) {
+		std::cerr << "Couldn't open " << filepath << " for writing" << std::endl;
+		return false;
+	}
+	bool written = fwrite(png.data(), 1, png.size(), f) == png.size();
+	written = fclose(f) == 0 && written;
+	if (!written)
+		std::cerr << "Couldn't write " << filepath << std::endl;
+	return written;
+}
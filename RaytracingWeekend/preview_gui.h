@@ -18,10 +18,10 @@ struct interaction_state{
 
 class preview_gui {
 public:
-    preview_gui(std::string filename, const int width, const int height) : filename(filename), width(width), height(height) {};
+    preview_gui(std::string png_path, std::string exr_path, const int width, const int height) : width(width), height(height), png_path(png_path), exr_path(exr_path) {};
     
-    int open_gui(threaded_renderer& renderer, hittable& world, camera& cam) {
-        renderer.render(world, cam);
+    int open_gui(threaded_renderer& renderer, hittable& world, camera& cam, const light_list* lights = nullptr) {
+        renderer.render(world, cam, lights);
 
         sf::RenderWindow window(sf::VideoMode(width, height), "Raytracer",
             sf::Style::Default | sf::Style::Close | sf::Style::Resize);
@@ -59,12 +59,17 @@ public:
             window.draw(sprite);
             window.display();
 
-            if (renderer.finished()) {
+            const interaction_state input = get_input(window);
+            if (input.movement != vec3(0, 0, 0)) {
+                // Abort the current frame right away and restart it from the new camera position
+                renderer.cancel();
+                cam.move(input.movement);
+                renderer.render(world, cam, lights);
+            }
+            else if (renderer.finished()) {
                 finished_rendering = true;
-                renderer.render(world, cam); 
 
-                cam.move(get_input(window).movement);
-                ray r = cam.get_mouse_ray(get_input(window).click.x, get_input(window).click.y);
+                ray r = cam.get_mouse_ray(input.click.x, input.click.y);
                 hit_record rec;
                 if (world.hit(r, global_t_min, infinity, rec))
                     std::cerr << rec.p.x<<" "<<rec.p.y<<" "<<rec.p.z;
@@ -75,15 +80,15 @@ public:
             sf::sleep(sf::milliseconds(100));
         }
 
-        tex.copyToImage().saveToFile(filename + ".png");
-        std::cerr << "Saved image to "<< filename+".png" << std::endl;
+        bool saved = tex.copyToImage().saveToFile(png_path);
+        if (saved)
+            std::cerr << "Saved image to "<< png_path << std::endl;
 
 #ifdef EXR_SUPPORT
-        const std::string exr_path = filename + ".exr";
-        write_exr_file(exr_path.c_str(), width, height, renderer.pixels);
+        saved = write_exr_file(exr_path.c_str(), width, height, renderer.pixels) && saved;
 #endif // EXR_SUPPORT
 
-        return 0;
+        return saved ? 0 : 1;
     }
 
 private:
@@ -158,5 +163,5 @@ private:
 }
 private:
     const int width, height;
-    std::string filename;
+    std::string png_path, exr_path;
 };
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "quad.h"
+#include "box.h"
+
+#include <cstdint>
+
+// The primitive types that the BVH intersects without a virtual call. Everything else (bvh_node, fog,
+// rotate_y, triangle_mesh, ...) still works through the hittable interface as "other".
+enum class primitive_type : uint8_t {
+    sphere,
+    triangle,
+    box,
+    xy_rect,
+    xz_rect,
+    yz_rect,
+    other
+};
+
+// Reference from a BVH leaf into the array of its type
+struct primitive_ref {
+    uint32_t type : 3;
+    uint32_t index : 29;
+};
+static_assert(sizeof(primitive_ref) == 4, "primitive_ref should be a single 32 bit word");
+
+// Stores a copy of every known primitive in a contiguous array per type. The types are final, so the
+// switch in hit() calls (and inlines) their hit functions directly.
+class primitive_store {
+public:
+    primitive_ref add(const shared_ptr<hittable>& object) {
+        // Only called while building, the dynamic_casts are not on the hot path
+        const hittable* ptr = object.get();
+        if (auto p = dynamic_cast<const sphere*>(ptr)) return add_to(spheres, primitive_type::sphere, *p);
+        if (auto p = dynamic_cast<const triangle*>(ptr)) return add_to(triangles, primitive_type::triangle, *p);
+        if (auto p = dynamic_cast<const box*>(ptr)) return add_to(boxes, primitive_type::box, *p);
+        if (auto p = dynamic_cast<const xy_rect*>(ptr)) return add_to(xy_rects, primitive_type::xy_rect, *p);
+        if (auto p = dynamic_cast<const xz_rect*>(ptr)) return add_to(xz_rects, primitive_type::xz_rect, *p);
+        if (auto p = dynamic_cast<const yz_rect*>(ptr)) return add_to(yz_rects, primitive_type::yz_rect, *p);
+        return add_to(others, primitive_type::other, object);
+    }
+
+    inline bool hit(primitive_ref ref, const ray& r, real t_min, real t_max, hit_record& rec) const {
+        switch (static_cast<primitive_type>(ref.type)) {
+        case primitive_type::sphere: return spheres[ref.index].hit(r, t_min, t_max, rec);
+        case primitive_type::triangle: return triangles[ref.index].hit(r, t_min, t_max, rec);
+        case primitive_type::box: return boxes[ref.index].hit(r, t_min, t_max, rec);
+        case primitive_type::xy_rect: return xy_rects[ref.index].hit(r, t_min, t_max, rec);
+        case primitive_type::xz_rect: return xz_rects[ref.index].hit(r, t_min, t_max, rec);
+        case primitive_type::yz_rect: return yz_rects[ref.index].hit(r, t_min, t_max, rec);
+        default: return others[ref.index]->hit(r, t_min, t_max, rec);
+        }
+    }
+
+    inline bool occluded(primitive_ref ref, const ray& r, real t_min, real t_max) const {
+        switch (static_cast<primitive_type>(ref.type)) {
+        case primitive_type::sphere: return spheres[ref.index].occluded(r, t_min, t_max);
+        case primitive_type::triangle: return triangles[ref.index].occluded(r, t_min, t_max);
+        case primitive_type::box: return boxes[ref.index].occluded(r, t_min, t_max);
+        case primitive_type::xy_rect: return xy_rects[ref.index].occluded(r, t_min, t_max);
+        case primitive_type::xz_rect: return xz_rects[ref.index].occluded(r, t_min, t_max);
+        case primitive_type::yz_rect: return yz_rects[ref.index].occluded(r, t_min, t_max);
+        default: return others[ref.index]->occluded(r, t_min, t_max);
+        }
+    }
+
+    void shrink_to_fit() {
+        spheres.shrink_to_fit();
+        triangles.shrink_to_fit();
+        boxes.shrink_to_fit();
+        xy_rects.shrink_to_fit();
+        xz_rects.shrink_to_fit();
+        yz_rects.shrink_to_fit();
+        others.shrink_to_fit();
+    }
+
+    size_t memory_usage() const {
+        return spheres.size() * sizeof(sphere) + triangles.size() * sizeof(triangle) + boxes.size() * sizeof(box)
+            + xy_rects.size() * sizeof(xy_rect) + xz_rects.size() * sizeof(xz_rect) + yz_rects.size() * sizeof(yz_rect)
+            + others.size() * sizeof(shared_ptr<hittable>);
+    }
+
+private:
+    template<class T>
+    primitive_ref add_to(std::vector<T>& store, primitive_type type, const T& object) {
+        primitive_ref ref{ static_cast<uint32_t>(type), static_cast<uint32_t>(store.size()) };
+        store.push_back(object);
+        return ref;
+    }
+
+    std::vector<sphere> spheres;
+    std::vector<triangle> triangles;
+    std::vector<box> boxes;
+    std::vector<xy_rect> xy_rects;
+    std::vector<xz_rect> xz_rects;
+    std::vector<yz_rect> yz_rects;
+    std::vector<shared_ptr<hittable>> others;
+};
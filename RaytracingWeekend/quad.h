@@ -1,11 +1,14 @@
 #pragma once
 #include "hittable.h"
 
-class xy_rect : public hittable{
+class xy_rect final : public hittable {
 public:
-    xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> m) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mat_ptr(m) {}
+    xy_rect(real _x0, real _x1, real _y0, real _y1, real _k, shared_ptr<material> m) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mat_ptr(m) {}
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+    virtual real pdf_value(const point3& origin, const vec3& v) const override;
+    virtual vec3 random(const point3& origin, const vec2& u) const override;
     virtual bool bounding_box(aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Z
         // dimension a small amount.
@@ -14,17 +17,20 @@ public:
     }
 public:
     shared_ptr<material> mat_ptr;
-    double x0, x1, y0, y1, k;
+    real x0, x1, y0, y1, k;
 
 };
 
-class xz_rect : public hittable {
+class xz_rect final : public hittable {
 public:
-    xz_rect(double _x0, double _x1, double _z0, double _z1, double _k,
+    xz_rect(real _x0, real _x1, real _z0, real _z1, real _k,
         shared_ptr<material> mat)
         : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat) {};
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+    virtual real pdf_value(const point3& origin, const vec3& v) const override;
+    virtual vec3 random(const point3& origin, const vec2& u) const override;
 
     virtual bool bounding_box(aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Y
@@ -35,16 +41,19 @@ public:
 
 public:
     shared_ptr<material> mat_ptr;
-    double x0, x1, z0, z1, k;
+    real x0, x1, z0, z1, k;
 };
 
-class yz_rect : public hittable {
+class yz_rect final : public hittable {
 public:
-    yz_rect(double _y0, double _y1, double _z0, double _z1, double _k,
+    yz_rect(real _y0, real _y1, real _z0, real _z1, real _k,
         shared_ptr<material> mat)
         : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat) {};
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+    virtual real pdf_value(const point3& origin, const vec3& v) const override;
+    virtual vec3 random(const point3& origin, const vec2& u) const override;
 
     virtual bool bounding_box(aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the X
@@ -55,10 +64,10 @@ public:
 
 public:
     shared_ptr<material> mat_ptr;
-    double y0, y1, z0, z1, k;
+    real y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xy_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().z) * r.invdir().z;
     if (t < t_min || t > t_max)
         return false;
@@ -75,7 +84,7 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().y) * r.invdir().y;
     if (t < t_min || t > t_max)
         return false;
@@ -91,7 +100,7 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool yz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().x) * r.invdir().x;
     if (t < t_min || t > t_max)
         return false;
@@ -105,4 +114,66 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.mat_ptr = mat_ptr.get();
     rec.p = r.at(t);
     return true;
+}
+
+bool xy_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().z) * r.invdir().z;
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x + t * r.direction().x;
+    auto y = r.origin().y + t * r.direction().y;
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+bool xz_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().y) * r.invdir().y;
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x + t * r.direction().x;
+    auto z = r.origin().z + t * r.direction().z;
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
+bool yz_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().x) * r.invdir().x;
+    if (t < t_min || t > t_max)
+        return false;
+    auto y = r.origin().y + t * r.direction().y;
+    auto z = r.origin().z + t * r.direction().z;
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
+// Solid angle density of uniformly sampling a point on a planar shape of the given area, seen from origin along v
+inline real area_pdf_to_solid_angle(const hittable& shape, real area, const point3& origin, const vec3& v) {
+    hit_record rec;
+    if (!shape.hit(ray(origin, v, white_wavelength), global_t_min, infinity, rec))
+        return 0;
+
+    const real distance_squared = rec.t * rec.t * glm::length2(v);
+    const real cosine = std::fabs(dot(v, rec.normal)) / glm::length(v);
+    return distance_squared / (cosine * area);
+}
+
+real xy_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return area_pdf_to_solid_angle(*this, (x1 - x0) * (y1 - y0), origin, v);
+}
+
+vec3 xy_rect::random(const point3& origin, const vec2& u) const {
+    return point3(x0 + u.x * (x1 - x0), y0 + u.y * (y1 - y0), k) - origin;
+}
+
+real xz_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return area_pdf_to_solid_angle(*this, (x1 - x0) * (z1 - z0), origin, v);
+}
+
+vec3 xz_rect::random(const point3& origin, const vec2& u) const {
+    return point3(x0 + u.x * (x1 - x0), k, z0 + u.y * (z1 - z0)) - origin;
+}
+
+real yz_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return area_pdf_to_solid_angle(*this, (y1 - y0) * (z1 - z0), origin, v);
+}
+
+vec3 yz_rect::random(const point3& origin, const vec2& u) const {
+    return point3(k, y0 + u.x * (y1 - y0), z0 + u.y * (z1 - z0)) - origin;
 }
\ No newline at end of file
@@ -0,0 +1,181 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <bit>
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Engines for the per sample random numbers (RANDOM in rtweekend.h). They are restarted by seed(seed, stream) for
+// every pixel sample, so all of them are cheap to seed. Each one is a UniformRandomBitGenerator with 32 bit results
+// (for the std distributions) and fills whole spans of doubles in [0, 1) with fill().
+
+inline uint64_t splitmix64(uint64_t& x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// PCG-XSH-RR with 64 bit state and a separate stream for every pixel
+class pcg32_engine {
+public:
+    using result_type = uint32_t;
+    static constexpr const char* name = "pcg32";
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    void seed(uint64_t seed, uint64_t stream) { gen.seed(seed, stream); }
+    result_type operator()() { return gen(); }
+    double next_double() { return gen() * 0x1p-32; }
+    void fill(std::span<double> out) {
+        for (double& x : out)
+            x = next_double();
+    }
+
+private:
+    pcg32 gen;
+};
+
+// PCG on a plain multiplicative generator, a bit faster than pcg32 but without streams, so the stream is hashed into the seed
+class pcg32_fast_engine {
+public:
+    using result_type = uint32_t;
+    static constexpr const char* name = "pcg32_fast";
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    void seed(uint64_t seed, uint64_t stream) { gen.seed(splitmix64(stream) ^ seed); }
+    result_type operator()() { return gen(); }
+    double next_double() { return gen() * 0x1p-32; }
+    void fill(std::span<double> out) {
+        for (double& x : out)
+            x = next_double();
+    }
+
+private:
+    pcg32_fast gen;
+};
+
+// xoshiro256** running 4 independent lanes side by side, one AVX2 register per state word. Single numbers are handed out
+// from the last block of 4, fill() writes whole blocks directly, both yield the same sequence. https://prng.di.unimi.it/
+class xoshiro_engine {
+public:
+    using result_type = uint32_t;
+    static constexpr const char* name = "xoshiro256**x4";
+    static constexpr int lanes = 4;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    xoshiro_engine() { seed(0, 0); }
+
+    void seed(uint64_t seed, uint64_t stream) {
+        // splitmix64 expansion, as recommended by the authors, never produces the all zero state
+        uint64_t x = splitmix64(stream) ^ seed;
+        for (int w = 0; w < 4; w++)
+            for (int l = 0; l < lanes; l++)
+                s[w][l] = splitmix64(x);
+        next = lanes;
+    }
+
+    result_type operator()() { return static_cast<result_type>(next_u64() >> 32); }
+    double next_double() { return to_double(next_u64()); }
+
+    void fill(std::span<double> out) {
+        double* p = out.data();
+        double* const end = p + out.size();
+        while (p != end && next < lanes)
+            *p++ = to_double(block[next++]);
+
+        const size_t blocks = static_cast<size_t>(end - p) / lanes;
+#if defined(__AVX2__)
+        if (blocks > 0) {
+            __m256i s0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[0]));
+            __m256i s1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[1]));
+            __m256i s2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[2]));
+            __m256i s3 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[3]));
+            const __m256i exponent = _mm256_set1_epi64x(0x3ff0000000000000ll);
+            const __m256d one = _mm256_set1_pd(1.0);
+            for (size_t b = 0; b < blocks; b++, p += lanes) {
+                const __m256i result = step(s0, s1, s2, s3);
+                const __m256i mantissa = _mm256_or_si256(_mm256_srli_epi64(result, 12), exponent);
+                _mm256_storeu_pd(p, _mm256_sub_pd(_mm256_castsi256_pd(mantissa), one));
+            }
+            _mm256_store_si256(reinterpret_cast<__m256i*>(s[0]), s0);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(s[1]), s1);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(s[2]), s2);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(s[3]), s3);
+        }
+#else
+        for (size_t b = 0; b < blocks; b++, p += lanes) {
+            step();
+            for (int l = 0; l < lanes; l++)
+                p[l] = to_double(block[l]);
+        }
+#endif
+        while (p != end)
+            *p++ = next_double();
+    }
+
+private:
+    // The top 52 bits as the mantissa of a double in [1, 2), the same conversion as the AVX2 path
+    static double to_double(uint64_t v) { return std::bit_cast<double>((v >> 12) | 0x3ff0000000000000ull) - 1.0; }
+
+    uint64_t next_u64() {
+        if (next == lanes) {
+            step();
+            next = 0;
+        }
+        return block[next++];
+    }
+
+#if defined(__AVX2__)
+    // Advances the 4 lanes (one state word per register), returns their next outputs
+    static __m256i step(__m256i& s0, __m256i& s1, __m256i& s2, __m256i& s3) {
+        const __m256i s1_5 = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+        const __m256i rotated = _mm256_or_si256(_mm256_slli_epi64(s1_5, 7), _mm256_srli_epi64(s1_5, 57));
+        const __m256i result = _mm256_add_epi64(_mm256_slli_epi64(rotated, 3), rotated);
+        const __m256i t = _mm256_slli_epi64(s1, 17);
+        s2 = _mm256_xor_si256(s2, s0);
+        s3 = _mm256_xor_si256(s3, s1);
+        s1 = _mm256_xor_si256(s1, s2);
+        s0 = _mm256_xor_si256(s0, s3);
+        s2 = _mm256_xor_si256(s2, t);
+        s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+        return result;
+    }
+#endif
+
+    void step() {
+#if defined(__AVX2__)
+        __m256i s0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[0]));
+        __m256i s1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[1]));
+        __m256i s2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[2]));
+        __m256i s3 = _mm256_load_si256(reinterpret_cast<const __m256i*>(s[3]));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(block), step(s0, s1, s2, s3));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(s[0]), s0);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(s[1]), s1);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(s[2]), s2);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(s[3]), s3);
+#else
+        for (int l = 0; l < lanes; l++) {
+            block[l] = std::rotl(s[1][l] * 5, 7) * 9;
+            const uint64_t t = s[1][l] << 17;
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s[1][l];
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= t;
+            s[3][l] = std::rotl(s[3][l], 45);
+        }
+#endif
+    }
+
+    alignas(32) uint64_t s[4][lanes];
+    alignas(32) uint64_t block[lanes];
+    int next;
+};
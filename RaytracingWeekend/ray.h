@@ -13,10 +13,10 @@ public:
 
 	point3 origin() const { return orig; }
 	vec3 direction() const { return dir; }
-	vec3 invdir() const { return 1./dir; }
+	vec3 invdir() const { return real(1)/dir; }
 	double lambda() const { return wavelength; }
 
-	point3 at(double t) const {
+	point3 at(real t) const {
 		return orig + dir * t;
 	}
 };
@@ -2,11 +2,20 @@
 
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <chrono>
 #include <iostream>
 
 #include "rtweekend.h"
 #include "hittable_list.h"
+#include "light_list.h"
 #include "camera.h"
 #include "material.h"
 #include "color.h"
@@ -14,46 +23,125 @@
 #include "spectrum.h"
 #include "variance_welford.h"
 
+// Number of rays traced by the current thread, summed up per tile into threaded_renderer::rays_traced
+static thread_local std::size_t thread_rays_traced = 0;
+
 struct tile
 {
-    const int x, y, x_end, y_end;
+    int x, y, x_end, y_end;
+    int id = 0; // index into the tiles of the renderer
     tile(int x0, int y0, int width, int height) : x(x0), y(y0), x_end(x0 + width), y_end(y0 + height){};
     tile() : x(0), y(0), x_end(0), y_end(0){};
 };
 
-color ray_color(const ray &r, const hittable &h, int depth, normal3 &normal)
+// Next event estimation: samples a point on one of the lights, traces a shadow ray towards it and returns its emission,
+// weighted against the brdf sampling with multiple importance sampling. The result still has to be multiplied with the
+// attenuation of the path up to this hit.
+path_color sample_direct_light(const ray &r_in, const hit_record &rec, const hittable &h, const light_list &lights, pixel_sampler &sampler, const sampled_wavelengths *wavelengths)
+{
+    const hittable &light = lights.pick(sampler.get1d());
+    const vec3 direction = light.random(rec.p, sampler.get2d());
+    const real scattering_pdf = rec.mat_ptr->pdf(r_in, rec, direction);
+    if (scattering_pdf <= 0) // light below the surface
+        return path_color(0);
+
+#ifdef SINGLE_PRECISION
+    const ray shadow_ray(offset_ray_origin(rec.p, rec.normal, direction), direction, r_in.lambda());
+#else
+    const ray shadow_ray(rec.p, direction, r_in.lambda());
+#endif
+    hit_record light_rec;
+    const real light_pdf = lights.pdf_value(light, rec.p, direction);
+    if (light_pdf <= 0 || !light.hit(shadow_ray, ray_t_min, infinity, light_rec))
+        return path_color(0);
+
+    // Anything in between, other lights included, hides the sampled point. The shadow ray ends just before the light
+    ++thread_rays_traced;
+    if (h.occluded(shadow_ray, ray_t_min, light_rec.t * real(0.999)))
+        return path_color(0);
+
+    const path_color f = to_path_color(rec.mat_ptr->eval(r_in, rec, direction), wavelengths);
+    const path_color emitted = to_path_color(light_rec.mat_ptr->emitted(shadow_ray, light_rec), wavelengths);
+    return f * emitted * (power_heuristic(light_pdf, scattering_pdf) / light_pdf);
+}
+
+// Paths end at a non scattering hit, when they leave the scene, after depth bounces, or by Russian roulette once they
+// are longer than roulette_depth bounces. With DISPERSION the path carries the wavelengths (required then), r the hero
+// one, and the RGB colors of the scene are upsampled to their spectra.
+color ray_color(const ray &r, const hittable &h, const light_list *lights, int depth, int roulette_depth, pixel_sampler &sampler, normal3 &normal, const sampled_wavelengths *wavelengths = nullptr)
 {
-    color result{0, 0, 0};
-    vec3 attenuation{1, 1, 1};
+    path_color result(0);
+    path_color attenuation(1);
     normal = {0, -1, 0}; // set normal to a sensible default for rays that didn't hit anything
     ray current_ray = r;
+    const bool sample_lights = lights && !lights->empty();
+    real scattering_pdf = 0; // of current_ray, 0 if the light sampling couldn't have found its direction (camera rays, specular bounces)
+#ifdef DISPERSION
+    bool hero_only = false;  // a dispersive surface ended the secondary wavelengths
+#endif
 
     bool hitDiffuse = false;
     for (int i = 0; i < depth; i++)
     {
         hit_record rec;
 
-        if (h.hit(current_ray, global_t_min, infinity, rec))
+        ++thread_rays_traced;
+        if (h.hit(current_ray, ray_t_min, infinity, rec))
         {
             // We hit an object, update color based on emission and attenuation
-            color emitted = rec.mat_ptr->emitted(current_ray, rec);
-            ray scattered;
+            const material &mat = *rec.mat_ptr;
+            color emitted = mat.is_emissive() ? mat.emitted(current_ray, rec) : color(0, 0, 0);
+            bsdf_sample scattered;
+
+            // The light sampling at the previous hit already accounts for part of this emission
+            if (scattering_pdf > 0 && mat.is_emissive())
+                emitted *= power_heuristic(scattering_pdf, lights->pdf_value(current_ray.origin(), current_ray.direction(), rec.t));
 
             // Store the normal of the first diffuse/opaque ray hit
-            if (!hitDiffuse && (dynamic_cast<dielectric *>(rec.mat_ptr) == nullptr) && (dynamic_cast<thinfilm *>(rec.mat_ptr) == nullptr))
+            if (!hitDiffuse && !mat.is_transmissive())
             {
                 normal = rec.normal;
                 hitDiffuse = true;
             }
 
-            if (rec.mat_ptr->scatter(current_ray, rec, attenuation, scattered))
+            if (mat.has_scatter() && mat.sample(current_ray, rec, sampler.get3d(), scattered))
             {
-                result += emitted * attenuation;
-                current_ray = scattered;
+                result += to_path_color(emitted, wavelengths) * attenuation;
+                if (sample_lights && mat.is_diffuse())
+                    result += attenuation * sample_direct_light(current_ray, rec, h, *lights, sampler, wavelengths);
+
+#ifdef DISPERSION
+                if (!hero_only && mat.is_dispersive())
+                {
+                    // Everything after this depends on the hero wavelength alone, it stands in for all of them
+                    attenuation *= path_color(hero_wavelength_count, 0, 0, 0);
+                    hero_only = true;
+                }
+#endif
+                scattering_pdf = (sample_lights && mat.is_diffuse() && !scattered.specular) ? scattered.pdf : 0;
+
+                attenuation *= to_path_color(scattered.f, wavelengths) / scattered.pdf;
+
+                // Russian roulette: a path whose throughput dropped below 1 survives with that probability and the survivors
+                // are scaled up by it. Dim paths end early, the estimate stays unbiased.
+                const real max_throughput = max_component(attenuation);
+                if (i >= roulette_depth && max_throughput < 1)
+                {
+                    if (sampler.get1d() >= max_throughput)
+                        break;
+                    attenuation /= max_throughput;
+                }
+#ifdef SINGLE_PRECISION
+                // Without a global t_min, the spawned ray has to start off the surface
+                current_ray = ray(offset_ray_origin(rec.p, rec.normal, scattered.wo), scattered.wo, current_ray.lambda());
+#else
+                current_ray = ray(rec.p, scattered.wo, current_ray.lambda());
+#endif
             }
             else
             {
-                return result + emitted * attenuation;
+                result += to_path_color(emitted, wavelengths) * attenuation;
+                break;
             }
         }
         else
@@ -61,14 +149,15 @@ color ray_color(const ray &r, const hittable &h, int depth, normal3 &normal)
             // Background color / sky sphere
             // return color(0, 0, 0); // black sky
             vec3 unit_direction = glm::normalize(current_ray.direction());
-            auto t = 0.5 * (unit_direction.y + 1.0);
-            result += attenuation * ((1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0));
-            return result;
+            auto t = real(0.5) * (unit_direction.y + 1);
+            result += attenuation * to_path_color((1 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0), wavelengths);
+            break;
         }
     }
 
-    // Exceeded ray depth
-    return result = {0, 0, 0};
+    // Also reached when the path exceeded the ray depth, the light that was already gathered is kept (the direct light
+    // of every hit with light sampling)
+    return path_color_to_rgb(result, wavelengths);
 }
 
 // Function to calculate maximum variance
@@ -89,12 +178,55 @@ void override_variance(vector<weighted_variance_welford<color>>& pixel_colors, c
     }
 }
 
-void render_tile(vector<color> &output, vector<normal3> &output_normal, const hittable &world, const std::size_t sample_count, const int max_depth, const camera &cam, const tile tile)
+// Relative error of a pixel estimate (95% confidence interval over the mean), the noise metric of the adaptive sampling.
+// It is computed per channel: a channel with a (near) zero mean has no error when it has no variance either, and an
+// undefined one otherwise. A pixel with an undefined error in any channel, or too little weight for a variance, is
+// never converged. Only comparisons are used, NaN checks would be optimized away under -Ofast.
+inline double relative_error(const weighted_variance_welford<color> &pixel_color)
+{
+    constexpr double min_mean = 1e-10;
+    if (pixel_color.get_weight_sum() <= 1)
+        return infinity;
+    const color mean = pixel_color.mean();
+    const color convergence = pixel_color.convergence();
+    color error;
+    for (int c = 0; c < 3; ++c)
+    {
+        if (mean[c] > min_mean)
+            error[c] = convergence[c] / mean[c];
+        else if (convergence[c] > 0)
+            return infinity;
+        else
+            error[c] = 0;
+    }
+    return luminance(error);
+}
+
+// Traces sample s of pixel (i, j) and adds it to the pixel estimate
+inline void add_pixel_sample(weighted_variance_welford<color> &pixel_color, normal3 &normal, const hittable &world, const light_list *lights, int i, int j, const std::size_t s, const std::size_t sample_count, const int max_depth, const int roulette_depth, const camera &cam)
+{
+    // s counts from 1
+    seed_sample_stream(static_cast<uint64_t>(j) * cam.image_width + i, s);
+    pixel_sampler sampler(i, j, s - 1, sample_count, cam.image_width, cam.image_height, active_sampler);
+    PixelSample sample = sample_pixel(i, j, cam.image_width, cam.image_height, sampler.get2d());
+    ray r = cam.get_ray(sample.u, sample.v, sampler.get2d());
+#ifdef DISPERSION
+    const sampled_wavelengths wavelengths = sample_wavelengths(sampler.get1d());
+    r = {r, wavelengths.hero()}; // Apply the hero wavelength to the ray
+    const color sample_color = ray_color(r, world, lights, max_depth, roulette_depth, sampler, normal, &wavelengths);
+#else
+    const color sample_color = ray_color(r, world, lights, max_depth, roulette_depth, sampler, normal);
+#endif // DISPERSION
+    pixel_color.add_sample(sample_color, sample.weight);
+}
+
+// Renders a single tile on a thread, returns the number of samples taken (pixels stop early once they are converged)
+std::size_t render_tile(vector<color> &output, vector<normal3> &output_normal, vector<int> &output_samples, const hittable &world, const light_list *lights, const std::size_t sample_count, const int max_depth, const int roulette_depth, const camera &cam, const tile tile, const std::atomic_bool &cancelled)
 {
-    // for rendering a single tile on a thread
+    std::size_t samples_taken = 0;
     vector<weighted_variance_welford<color>> pixel_colors;
     pixel_colors.resize((tile.x_end - tile.x) * (tile.y_end - tile.y));
-    int sample_batch_size = sample_count/20;
+    const std::size_t sample_batch_size = std::max<std::size_t>(1, sample_count / 20); // at least 1, small sample counts would divide by 0 below
 
     for (int i = tile.x_end - 1; i >= tile.x; --i)
     {
@@ -104,26 +236,18 @@ void render_tile(vector<color> &output, vector<normal3> &output_normal, const hi
             std::size_t s;
             for (s = 1; s <= sample_count; ++s)
             {
-                PixelSample sample = sample_pixel(i, j, cam.image_width, cam.image_height, s);
-                ray r = cam.get_ray(sample.u, sample.v);
-#ifdef DISPERSION
-                auto lambda_weight_pair = random_wavelength(s, sample_count);
-                r = {r, lambda_weight_pair.first}; // Apply the wavelength to a ray
-#endif                                             // DISPERSION
-                color sample_color = ray_color(r, world, max_depth, output_normal[j * cam.image_width + i]);
-
-#ifdef DISPERSION
-                sample_color *= lambda_to_rgb(r.lambda());
-                sample.weight *= lambda_weight_pair.second; // Weight for the wavelength sample
-#endif                                                      // DISPERSION
-                pixel_color.add_sample(sample_color, sample.weight);
+                // Checked between samples, so an aborted frame stops within one sample per thread
+                if (cancelled.load(std::memory_order_relaxed))
+                    return samples_taken;
 
+                add_pixel_sample(pixel_color, output_normal[j * cam.image_width + i], world, lights, i, j, s, sample_count, max_depth, roulette_depth, cam);
+                ++samples_taken;
 
                 if(s%sample_batch_size == 0)
                 {
                     // Locally average the variance of neighboring pixels
                     // override_variance(pixel_colors, calculate_max_variance(pixel_colors));
-                    if( luminance(pixel_color.convergence() / pixel_color.mean()) < 2./std::sqrt(sample_count))
+                    if( relative_error(pixel_color) < 2./std::sqrt(sample_count))
                     {
                         // Early exit if the pixel is converged
                         break;
@@ -131,20 +255,125 @@ void render_tile(vector<color> &output, vector<normal3> &output_normal, const hi
                 }
             }
             output[j * cam.image_width + i] = pixel_color.mean();//color(static_cast<double>(s)/sample_count)
+            output_samples[j * cam.image_width + i] = static_cast<int>(std::min(s, sample_count));
+        }
+    }
+    return samples_taken;
+}
+
+// One pass of progressive rendering: adds the samples [first_sample, last_sample) to every pixel of the tile. The
+// pixel estimates are kept for the whole image (accumulators), so later passes continue where this one stopped.
+// Pixels whose relative error is already below converged_error are skipped. Returns the number of samples taken.
+std::size_t render_tile_pass(vector<weighted_variance_welford<color>> &accumulators, vector<color> &output, vector<normal3> &output_normal, vector<int> &output_samples, const hittable &world, const light_list *lights, const std::size_t first_sample, const std::size_t last_sample, const std::size_t sample_count, const int max_depth, const int roulette_depth, const camera &cam, const tile tile, const double converged_error, const std::atomic_bool &cancelled)
+{
+    std::size_t samples_taken = 0;
+    for (int i = tile.x_end - 1; i >= tile.x; --i)
+    {
+        for (int j = tile.y_end - 1; j >= tile.y; --j)
+        {
+            const int pixel = j * cam.image_width + i;
+            if (relative_error(accumulators[pixel]) < converged_error)
+                continue;
+            for (std::size_t s = first_sample; s < last_sample; ++s)
+            {
+                if (cancelled.load(std::memory_order_relaxed))
+                    return samples_taken;
+                add_pixel_sample(accumulators[pixel], output_normal[pixel], world, lights, i, j, s, sample_count, max_depth, roulette_depth, cam);
+                ++samples_taken;
+                ++output_samples[pixel];
+            }
+            output[pixel] = accumulators[pixel].mean();
         }
     }
+    return samples_taken;
 }
 
-void consume_tiles(vector<color> &output, vector<normal3> &output_normal, const hittable &world, int sample_count, int max_depth, const camera &cam, const vector<tile> &tiles, std::atomic_int &tile_id, std::atomic_int &finished_threads)
+// Tiles of one frame, dealt round robin into one deque per worker. A worker takes tiles from the front of its
+// own deque and steals from the back of the others once it runs dry, so the last tiles of a frame are spread
+// over all threads. The tiles are coarse, a mutex per deque is cheap compared to rendering a tile.
+class tile_scheduler
 {
-    while (tile_id < tiles.size())
-    { // the queue is empty/tile is invalid, exit the thread
-        const tile next = tiles[tile_id++];
-        render_tile(output, output_normal, world, sample_count, max_depth, cam, next);
+public:
+    // Workers may already look for tiles while the deques are refilled, as long as their number stays the same
+    void reset(const vector<tile> &tiles, int workers)
+    {
+        if (queues.size() != static_cast<std::size_t>(workers))
+        {
+            queues.clear();
+            for (int i = 0; i < workers; ++i)
+                queues.push_back(std::make_unique<worker_queue>());
+        }
+        vector<std::deque<tile>> dealt(workers);
+        for (std::size_t i = 0; i < tiles.size(); ++i)
+            dealt[i % workers].push_back(tiles[i]);
+        for (int i = 0; i < workers; ++i)
+        {
+            std::lock_guard<std::mutex> lock(queues[i]->mutex);
+            queues[i]->tiles = std::move(dealt[i]);
+        }
+    }
+
+    bool next(int worker, tile &out)
+    {
+        if (pop(*queues[worker], out, false))
+            return true;
+        for (std::size_t i = 1; i < queues.size(); ++i)
+        {
+            if (pop(*queues[(worker + i) % queues.size()], out, true))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    struct worker_queue
+    {
+        std::mutex mutex;
+        std::deque<tile> tiles;
+    };
+
+    static bool pop(worker_queue &queue, tile &out, bool steal)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tiles.empty())
+            return false;
+        if (steal)
+        {
+            out = queue.tiles.back();
+            queue.tiles.pop_back();
+        }
+        else
+        {
+            out = queue.tiles.front();
+            queue.tiles.pop_front();
+        }
+        return true;
     }
-    ++finished_threads;
+
+    vector<std::unique_ptr<worker_queue>> queues;
+};
+
+// Restricts the thread to a single core, so its caches stay warm between frames. Only implemented on Linux.
+inline bool pin_thread_to_core(std::thread &thread, int core)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % std::max(1, default_thread_count()), &cpus);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpus) == 0;
+#else
+    return false;
+#endif
 }
 
+// Stopping rules of a progressive frame, on top of the sample count
+struct render_limits
+{
+    double time_budget = 0;         // seconds, 0 for no limit
+    double target_error = 0;        // relative error (see relative_error), 0 for 2/sqrt(sample_count)
+    double error_percentile = 0.95; // the frame is done once this fraction of the pixels is below target_error
+};
+
 class threaded_renderer
 {
 
@@ -172,62 +401,315 @@ private:
         }
         // create the tiny remainder tile in the bottom right corner
         tiles.push_back(tile(x_tiles * tile_size, y_tiles * tile_size, width % tile_size, height % tile_size));
+
+        // drop the empty remainder tiles if the image size is a multiple of the tile size
+        std::erase_if(tiles, [](const tile &t)
+                      { return t.x_end <= t.x || t.y_end <= t.y; });
+
+        // Render from the center outwards, that is where the interesting part of the image usually is
+        const auto distance_to_center = [this](const tile &t)
+        {
+            const int dx = t.x + t.x_end - width;
+            const int dy = t.y + t.y_end - height;
+            return dx * dx + dy * dy;
+        };
+        std::stable_sort(tiles.begin(), tiles.end(), [&distance_to_center](const tile &a, const tile &b)
+                         { return distance_to_center(a) < distance_to_center(b); });
+        for (std::size_t i = 0; i < tiles.size(); ++i)
+            tiles[i].id = static_cast<int>(i);
+    }
+
+    // Sum of the relative errors above the noise target of the pixels in the tile, 0 once all of them are converged.
+    // Ranking by the excess error puts the samples where they bring the most pixels below the target.
+    double tile_error(const tile &t) const
+    {
+        const double target = noise_target();
+        double error = 0;
+        for (int j = t.y; j < t.y_end; ++j)
+            for (int i = t.x; i < t.x_end; ++i)
+                error += std::max(0., relative_error(accumulators[j * width + i]) - target);
+        return error;
+    }
+
+    // Relative error that error_percentile of the pixels are below
+    double percentile_error() const
+    {
+        vector<float> errors(accumulators.size());
+        std::transform(accumulators.begin(), accumulators.end(), errors.begin(), [](const auto &pixel_color)
+                       { return static_cast<float>(relative_error(pixel_color)); });
+        const std::size_t k = std::min(errors.size() - 1, static_cast<std::size_t>(limits.error_percentile * errors.size()));
+        std::nth_element(errors.begin(), errors.begin() + k, errors.end());
+        return errors[k];
+    }
+
+    bool over_time_budget() const
+    {
+        return limits.time_budget > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count() >= limits.time_budget;
+    }
+
+    // Ends the frame early, because the time budget is used up
+    void finish_frame()
+    {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            if (frame_done)
+                return;
+            frame_done = true;
+        }
+        pass_started.notify_all();
+    }
+
+    // Called by the worker that finished the last tile of a pass, while the others wait for the next pass.
+    // The frame is done once the error target or the time budget is reached. Otherwise, tiles that reached
+    // the noise target or the sample count are done, the rest is rendered again with the noisiest tiles first.
+    void start_next_pass()
+    {
+        achieved_error = percentile_error();
+        // As for the tiles, the error estimate is only trusted after two passes (a single sample has no variance)
+        if ((pass > 0 && achieved_error <= noise_target()) || over_time_budget())
+        {
+            finish_frame();
+            return;
+        }
+
+        vector<std::pair<double, int>> ranked;
+        for (const tile &t : tiles)
+        {
+            if (tile_samples[t.id] >= sample_count)
+                continue;
+            const double error = tile_error(t);
+            // A single pass has too few samples for a reliable variance estimate
+            if (tile_samples[t.id] >= 2 * samples_per_pass && error == 0)
+                continue;
+            ranked.emplace_back(error, t.id);
+        }
+        std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b)
+                         { return a.first > b.first; });
+
+        vector<tile> next_tiles;
+        next_tiles.reserve(ranked.size());
+        for (const auto &entry : ranked)
+            next_tiles.push_back(tiles[entry.second]);
+
+        pass_tiles_done = 0;
+        pass_tiles = static_cast<int>(next_tiles.size());
+        scheduler.reset(next_tiles, num_threads);
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            if (next_tiles.empty())
+                frame_done = true;
+            ++pass;
+        }
+        pass_started.notify_all();
+    }
+
+    void consume_passes(int worker, const hittable &world, const light_list *lights, const camera &cam)
+    {
+        while (!cancelled)
+        {
+            const unsigned current_pass = pass;
+            tile next;
+            if (over_time_budget())
+            {
+                // Leave the remaining tiles of the pass
+                finish_frame();
+                break;
+            }
+            if (scheduler.next(worker, next))
+            {
+                const std::size_t pass_samples = static_cast<std::size_t>(samples_per_pass);
+                const std::size_t first_sample = tile_samples[next.id] + 1;
+                const std::size_t last_sample = std::min<std::size_t>(first_sample + pass_samples, sample_count + 1);
+                thread_rays_traced = 0;
+                // Same rule as for the tiles, the error estimate of a pixel is only trusted after two passes
+                const double converged_error = first_sample > 2 * pass_samples ? noise_target() : 0.;
+                samples_traced += render_tile_pass(accumulators, pixels, pixels_normal, pixels_samples, world, lights, first_sample, last_sample, sample_count, max_depth, roulette_depth, cam, next, converged_error, cancelled);
+                tile_samples[next.id] = static_cast<int>(last_sample - 1);
+                rays_traced += thread_rays_traced;
+                samples_done += (last_sample - first_sample) * (next.x_end - next.x) * (next.y_end - next.y);
+                if (++pass_tiles_done == pass_tiles && !cancelled)
+                    start_next_pass();
+                continue;
+            }
+
+            // Out of tiles, wait until the last tile of this pass is finished
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            pass_started.wait(lock, [&]
+                              { return cancelled || frame_done || pass != current_pass; });
+            if (frame_done)
+                break;
+        }
+        // The last worker out measures the error of the finished frame, nobody writes to the accumulators anymore
+        if (++workers_done == num_threads && !cancelled)
+            achieved_error = percentile_error();
+        ++finished_threads;
+    }
+
+    void consume_tiles(int worker, const hittable &world, const light_list *lights, const camera &cam)
+    {
+        tile next;
+        while (!cancelled && scheduler.next(worker, next))
+        {
+            thread_rays_traced = 0;
+            samples_traced += render_tile(pixels, pixels_normal, pixels_samples, world, lights, sample_count, max_depth, roulette_depth, cam, next, cancelled);
+            rays_traced += thread_rays_traced;
+            ++tiles_done;
+        }
+        ++finished_threads;
+    }
+
+    // Body of the pool threads: sleep until a frame is started, help rendering it and go back to sleep
+    void worker_loop(int worker)
+    {
+        unsigned seen_frame = 0;
+        while (true)
+        {
+            const hittable *world;
+            const light_list *lights;
+            const camera *cam;
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                frame_started.wait(lock, [&]
+                                   { return shutdown || (frame_active && frame != seen_frame); });
+                if (shutdown)
+                    return;
+                seen_frame = frame;
+                world = frame_world;
+                lights = frame_lights;
+                cam = frame_camera;
+                ++active_workers;
+            }
+
+            if (frame_progressive)
+                consume_passes(worker, *world, lights, *cam);
+            else
+                consume_tiles(worker, *world, lights, *cam);
+
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                --active_workers;
+            }
+            worker_idle.notify_all();
+        }
     }
 
 public:
-    threaded_renderer(const int width, const int height, const int tile_size = 32, int sample_count = 100, int max_depth = 50) : width(width), height(height),
-                                                                                                                                 pixels({static_cast<size_t>(width * height)}),
-                                                                                                                                 pixels_normal({static_cast<size_t>(width * height)}),
+    // thread_count 0 uses one thread per hardware thread
+    threaded_renderer(const int width, const int height, const int tile_size = 32, int sample_count = 100, int max_depth = 50, bool pin_threads = false, int thread_count = 0) : width(width), height(height),
+                                                                                                                                 num_threads(thread_count > 0 ? thread_count : default_thread_count()),
                                                                                                                                  tile_size(tile_size),
                                                                                                                                  sample_count(sample_count), max_depth(max_depth),
-                                                                                                                                 num_threads(std::thread::hardware_concurrency())
+                                                                                                                                 samples_per_pass(std::max(1, sample_count / 20)),
+                                                                                                                                 pixels({static_cast<size_t>(width * height)}),
+                                                                                                                                 pixels_normal({static_cast<size_t>(width * height)}),
+                                                                                                                                 pixels_samples(static_cast<size_t>(width * height))
     {
         create_tiles(); // these are the jobs for the thread pool
+
+        // The pool lives as long as the renderer, its threads sleep between frames instead of being recreated
+        threads.reserve(num_threads);
+        for (int i = 0; i < num_threads; ++i)
+        {
+            threads.emplace_back(&threaded_renderer::worker_loop, this, i);
+            if (pin_threads && !pin_thread_to_core(threads.back(), i))
+                std::cerr << "Couldn't pin render thread " << i << " to a core\n";
+        }
+        std::cerr << "Created " << threads.size() << " rendering threads\n";
+    }
+
+    ~threaded_renderer()
+    {
+        cancel();
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            shutdown = true;
+        }
+        frame_started.notify_all();
+        for (auto &t : threads)
+            t.join();
     }
 
     double get_percentage() const
     {
-        return tile_id / static_cast<double>(tiles.size());
+        if (finished())
+            return 1.;
+        if (frame_progressive)
+            return samples_done / (static_cast<double>(width) * height * sample_count);
+        return tiles_done / static_cast<double>(tiles.size());
+    }
+
+    // Below this relative error a pixel (or in progressive mode a tile) counts as converged
+    double noise_target() const
+    {
+        return limits.target_error > 0 ? limits.target_error : 2. / std::sqrt(sample_count);
+    }
+
+    // error_percentile of the pixels of the last progressive frame have a relative error below this
+    double get_achieved_error() const
+    {
+        return achieved_error;
+    }
+
+    // Aborts the current frame, returns once all render threads are idle again
+    void cancel()
+    {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        cancelled = true;
+        frame_active = false; // threads that haven't woken up yet must not start the aborted frame
+        pass_started.notify_all();
+        worker_idle.wait(lock, [this]
+                         { return active_workers == 0; });
+        cancelled = false;
     }
 
     void stop_render()
     {
-        for (auto &t : threads)
-            t.join();
-        threads.clear();
+        cancel();
         finished_threads = 0;
-        tile_id = 0;
+        tiles_done = 0;
+        samples_done = 0;
+        rays_traced = 0;
+        samples_traced = 0;
+        std::fill(pixels_samples.begin(), pixels_samples.end(), 0);
 
         // Show the previous frame grayed out
         std::transform(pixels.begin(), pixels.end(), pixels.begin(), [](auto &c)
-                       { return c * 0.33; });
+                       { return c * real(0.33); });
         // std::fill(pixels.begin(), pixels.end(), color(0, 0, 0));
     }
 
-    void render(hittable &world, camera &cam)
+    // lights are sampled explicitly at every diffuse hit, without them (nullptr) only the scattered rays find the emitters
+    void render(const hittable &world, const camera &cam, const light_list *lights = nullptr)
     {
         stop_render();
         std::cerr << "Starting render with " << sample_count << " samples and " << max_depth << " bounces at " << width << "x" << height << std::endl;
 
-        // create the threads for our pool, each one will independently take tiles from the queue and render them one by one until the queue is empty
-        threads.resize(num_threads);
+        frame_progressive = progressive;
+        frame_start = std::chrono::steady_clock::now();
+        if (frame_progressive)
+        {
+            achieved_error = infinity;
+            workers_done = 0;
+            // Every pixel estimate starts over, the first pass renders all tiles
+            accumulators.assign(static_cast<size_t>(width * height), weighted_variance_welford<color>());
+            tile_samples.assign(tiles.size(), 0);
+            pass = 0;
+            pass_tiles = static_cast<int>(tiles.size());
+            pass_tiles_done = 0;
+        }
 
-        for (int i = 0; i < std::min(num_threads, (int)tiles.size()); ++i)
+        // wake up the pool, each thread takes tiles from its own queue (or steals them from the others) and renders them one by one until all queues are empty
+        scheduler.reset(tiles, num_threads);
         {
-            threads[i] = std::thread(
-                consume_tiles,
-                ref(pixels),
-                ref(pixels_normal),
-                ref(world),
-                sample_count,
-                max_depth,
-                ref(cam),
-                ref(tiles),
-                ref(tile_id),
-                ref(finished_threads));
-            // threads[i].detach();
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            frame_done = false;
+            frame_world = &world;
+            frame_lights = lights;
+            frame_camera = &cam;
+            frame_active = true;
+            ++frame;
         }
-        std::cerr << "Created " << threads.size() << " rendering threads\n";
+        frame_started.notify_all();
     }
 
     bool finished() const
@@ -239,12 +721,47 @@ public:
     const int width, height;
     const int num_threads;
     const int tile_size, sample_count, max_depth;
+    // Progressive mode renders the image in passes of samples_per_pass samples per pixel, after the first pass
+    // only the tiles above the noise target are refined. Otherwise every tile is rendered to completion at once.
+    bool progressive = true;
+    int samples_per_pass;
+    int roulette_depth = 5; // bounces before Russian roulette can end a path, max_depth stays the hard limit
+    render_limits limits; // progressive mode only
     vector<color> pixels;
     vector<normal3> pixels_normal;
+    vector<int> pixels_samples; // samples taken per pixel in the current frame
+    std::atomic<std::size_t> rays_traced = 0; // of the current frame
+    std::atomic<std::size_t> samples_traced = 0; // camera rays of the current frame
 
 private:
     vector<std::thread> threads;
     vector<tile> tiles;
-    std::atomic_int tile_id = 0;
+    tile_scheduler scheduler;
+
+    // Pool state, guarded by pool_mutex
+    std::mutex pool_mutex;
+    std::condition_variable frame_started, worker_idle, pass_started;
+    const hittable *frame_world = nullptr;
+    const light_list *frame_lights = nullptr;
+    const camera *frame_camera = nullptr;
+    unsigned frame = 0;
+    bool frame_active = false;
+    bool shutdown = false;
+    int active_workers = 0;
+    bool frame_done = false;
+
+    // Progressive rendering
+    bool frame_progressive = false;
+    vector<weighted_variance_welford<color>> accumulators; // per pixel, for the whole frame
+    vector<int> tile_samples;                             // samples per pixel rendered so far, per tile
+    std::atomic<unsigned> pass = 0;
+    std::atomic_int pass_tiles = 0, pass_tiles_done = 0;
+    std::atomic<std::size_t> samples_done = 0;
+    std::chrono::steady_clock::time_point frame_start;
+    std::atomic<double> achieved_error = infinity;
+    std::atomic_int workers_done = 0;
+
+    std::atomic_bool cancelled = false;
+    std::atomic_int tiles_done = 0;
     std::atomic_int finished_threads = 0;
-};
\ No newline at end of file
+};
@@ -4,24 +4,48 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include "glm/gtx/norm.hpp"
 
+//#define SINGLE_PRECISION
+
+// Precision of the render core (rays, bounding boxes, primitives, hit records)
+#ifdef SINGLE_PRECISION
+typedef float real;
+typedef glm::highp_vec3 vec3;
+typedef glm::highp_vec2 vec2;
+#else
+typedef double real;
 typedef glm::highp_dvec3 vec3;
+typedef glm::highp_dvec2 vec2;
+#endif
 typedef vec3 point3;
 
 #include <random>
 #include <memory>
+#include <thread>
 #include "pcg_extras.hpp"
 #include "pcg_random.hpp"
 #include "pcg_uint128.hpp"
+#include "random_engine.h"
 
 #include <numbers>
+#include <bit>
+#include <limits>
 
 #define EXR_SUPPORT
 //#define DISPERSION
 #define LAMBERT_BEER
-
-static thread_local std::mt19937 twister{};
-static thread_local pcg32_fast pcgrng{};
-#define RANDOM twister //select the active random
+//#define RNG_PCG32_FAST
+//#define RNG_XOSHIRO
+
+// Generator behind RANDOM, pcg32 unless one of the RNG_ defines selects another one (compared by benchmarks/rng_benchmark.cpp)
+#if defined(RNG_XOSHIRO)
+typedef xoshiro_engine sample_engine;
+#elif defined(RNG_PCG32_FAST)
+typedef pcg32_fast_engine sample_engine;
+#else
+typedef pcg32_engine sample_engine;
+#endif
+static thread_local sample_engine sample_rng{}; // restarted for every pixel sample by seed_sample_stream
+#define RANDOM sample_rng //select the active random
 
 // random distribution
 static std::uniform_real_distribution<double> dis(0.0, 1.0);
@@ -35,12 +59,39 @@ using std::ref;
 using std::vector;
 
 // Constants
-const double global_t_min = 1e-6; //DBL_EPSILON?
-const double infinity = DBL_MAX;
+#ifdef SINGLE_PRECISION
+const real global_t_min = 1e-4f;
+const real ray_t_min = 0; // self intersections are avoided by offset_ray_origin instead
+#else
+const real global_t_min = 1e-6; //DBL_EPSILON?
+const real ray_t_min = global_t_min;
+#endif
+const real infinity = std::numeric_limits<real>::max();
 const double pi = std::numbers::pi_v<double>;
 const double aspect_ratio = 16.0 / 9.0;
 
 // Utility Functions
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ull;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= (v >> 33);
+    return v;
+}
+
+// Restarts the random numbers of the calling thread for one pixel sample. Every pixel has its own stream and every
+// sample its own starting point in it, so a sample draws the same numbers no matter which thread, tile or pass renders
+// it and any part of an image can be rendered separately and merged bit exactly.
+inline void seed_sample_stream(uint64_t pixel, uint64_t sample) {
+    RANDOM.seed(mix_bits(sample), pixel);
+}
+
+inline int default_thread_count() {
+    // Shared by the renderer and the BVH builder
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
 inline double clamp(const double x, const double min=0, const double max=1) {
     if (x > max)
         return max;
@@ -51,7 +102,13 @@ inline double clamp(const double x, const double min=0, const double max=1) {
 
 
 inline double random_double() {
-    return dis(RANDOM);
+    // Fixed conversion instead of uniform_real_distribution, whose results differ between standard libraries
+    return RANDOM.next_double();
+}
+
+// Several uniform numbers at once, in a fixed order (unlike random_double() calls in the arguments of one function call)
+inline void random_doubles(std::span<double> out) {
+    RANDOM.fill(out);
 }
 
 int random_int(const int min, const int max) {
@@ -69,32 +126,94 @@ double random_double(const double min, const double max) {
 }
 
 vec3 random_dir() {
-    return vec3(random_double(), random_double(), random_double());
+    double u[3];
+    random_doubles(u);
+    return vec3(u[0], u[1], u[2]);
 }
 
 vec3 random_dir(double min, double max) {
-    return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+    return random_dir() * real(max - min) + real(min);
 }
 
-vec3 random_in_unit_sphere() {
+// Two uniform numbers in [0, 1) for one sampling decision (a scattered direction, a point on the lens)
+inline vec2 random_sample2() {
+    double u[2];
+    random_doubles(u);
+    return vec2(u[0], u[1]);
+}
+
+// Rejection free warps from the unit square, so every sampling decision consumes a fixed number of dimensions
+inline vec3 sample_uniform_sphere(const vec2& u) {
+    const real z = 1 - 2 * u.x;
+    const real r = sqrt(std::max(real(0), 1 - z * z));
+    const real phi = real(2 * pi) * u.y;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
 
-    while (true) {
-        auto p = random_dir(-1, 1);
-        if (glm::length2(p) < 1)
-            return p;
+// Shirley-Chiu concentric mapping onto the unit disk (z = 0), it keeps neighbouring samples close together
+inline vec3 sample_concentric_disk(const vec2& u) {
+    const real ox = 2 * u.x - 1;
+    const real oy = 2 * u.y - 1;
+    if (ox == 0 && oy == 0)
+        return vec3(0, 0, 0);
+
+    real r, theta;
+    if (std::fabs(ox) > std::fabs(oy)) {
+        r = ox;
+        theta = real(pi / 4) * (oy / ox);
     }
+    else {
+        r = oy;
+        theta = real(pi / 2) - real(pi / 4) * (ox / oy);
+    }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+// Cosine weighted direction around +z (Malley's method: project the disk up onto the hemisphere)
+inline vec3 sample_cosine_hemisphere(const vec2& u) {
+    const vec3 d = sample_concentric_disk(u);
+    return vec3(d.x, d.y, sqrt(std::max(real(0), 1 - d.x * d.x - d.y * d.y)));
+}
+
+inline real cosine_hemisphere_pdf(real cos_theta) {
+    return cos_theta <= 0 ? 0 : real(cos_theta / pi);
+}
+
+vec3 random_in_unit_sphere() {
+    double u[3];
+    random_doubles(u);
+    return sample_uniform_sphere(vec2(u[0], u[1])) * real(std::cbrt(u[2]));
 }
 
 vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (glm::length2(p) < 1)
-            return p;
-    }
+    return sample_concentric_disk(random_sample2());
 }
 
 vec3 random_unit_vector() {
-    return glm::normalize(random_in_unit_sphere());
+    return sample_uniform_sphere(random_sample2());
+}
+
+inline point3 offset_ray_origin(const point3& p, const vec3& n, const vec3& direction) {
+#ifdef SINGLE_PRECISION
+    // Moves the origin of a spawned ray off the surface, by a few ulps along the normal (towards the side the
+    // ray leaves through). The offset scales with the magnitude of p, close to the origin a small fixed offset is used.
+    // "A Fast and Robust Method for Avoiding Self-Intersection", Waechter and Binder, Ray Tracing Gems chapter 6
+    constexpr float origin = 1.0f / 32.0f;
+    constexpr float float_scale = 1.0f / 65536.0f;
+    constexpr float int_scale = 256.0f;
+
+    const vec3 offset_dir = dot(n, direction) < 0 ? -n : n;
+    point3 offset_p;
+    for (int a = 0; a < 3; a++) {
+        const int offset_int = static_cast<int>(int_scale * offset_dir[a]);
+        const float p_int = std::bit_cast<float>(std::bit_cast<int>(p[a]) + ((p[a] < 0) ? -offset_int : offset_int));
+        offset_p[a] = std::abs(p[a]) < origin ? p[a] + float_scale * offset_dir[a] : p_int;
+    }
+    return offset_p;
+#else
+    // Double precision relies on global_t_min
+    return p;
+#endif
 }
 
 #include "spectrum.h"
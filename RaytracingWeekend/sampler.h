@@ -1,27 +1,212 @@
 #pragma once
 #include "rtweekend.h"
 
+#include <cstdint>
 
 /*
-Sampling Methods
-They return where the current pixel should be sampled, originating from the pixel center. The z coordinate does not have a meaning
+Sample Generators
+A pixel_sampler hands out the random numbers of one pixel sample, dimension by dimension in a fixed order: the
+pixel offset, the lens, the wavelength and then a few per bounce. The Sobol variants stratify every dimension over
+the samples of a pixel, the zsobol one additionally spreads the error between neighbouring pixels as blue noise.
 */
-static vec3 sample_uniform(int sample_index) {
-	return random_dir()-vec3(.5,.5,0.);
+
+enum class sampler_type {
+	independent, // uniform random numbers, hashed from the pixel, sample and dimension
+	sobol,       // Owen scrambled Sobol points, shuffled per pixel and dimension (padded 2D)
+	zsobol       // Owen scrambled Sobol points in Morton order over the whole image
+};
+
+inline uint32_t reverse_bits32(uint32_t v) {
+	v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+	v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+	v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+	v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+	return (v >> 16) | (v << 16);
+}
+
+inline uint64_t encode_morton2(uint32_t x, uint32_t y) {
+	auto spread = [](uint64_t v) {
+		v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+		v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+		v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+		v = (v | (v << 2)) & 0x3333333333333333ull;
+		v = (v | (v << 1)) & 0x5555555555555555ull;
+		return v;
+	};
+	return (spread(y) << 1) | spread(x);
 }
 
-static vec3 sample_center(int sample_index) {
-	return vec3();
+// Element i of a random permutation of [0, l) selected by p (Kensler, "Correlated Multi-Jittered Sampling")
+inline uint32_t permutation_element(uint32_t i, uint32_t l, uint32_t p) {
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;
+		i *= 0xe170893d;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3f;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3df;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l); // cycle walking, the power of 2 range is less than twice as large as l
+	return (i + p) % l;
 }
 
-static vec3 sample_normal(int sample_index) {
-	return vec3(random_normal_double(), random_normal_double(), 0.);
+// Hash based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling"): flips every bit depending on the
+// bits above it, which keeps the stratification of the Sobol points and decorrelates the dimensions
+inline uint32_t owen_scramble(uint32_t v, uint32_t seed) {
+	v = reverse_bits32(v);
+	v ^= v * 0x3d20adeau;
+	v += seed;
+	v *= (seed >> 16) | 1;
+	v ^= v * 0x05526c56u;
+	v ^= v * 0x53a22864u;
+	return reverse_bits32(v);
 }
 
-static vec3 sample_grid(int sample_index) {
-	return vec3((sample_index % 10) / 10.-.5, (sample_index/10.)/10. - .5, 0.);
+// Point a of the first (dim 0, van der Corput) or second (dim 1) Sobol dimension, scrambled with seed. Only these
+// two are needed, every pair of dimensions reuses them with its own shuffle and scramble. The generator matrix of the
+// second one is Pascal's triangle mod 2, its columns follow from each other with c ^ (c >> 1).
+inline double sobol_sample(uint64_t a, int dim, uint32_t seed) {
+	uint32_t v = 0;
+	for (uint32_t column = 0x80000000u; a != 0; a >>= 1, column = dim == 0 ? column >> 1 : column ^ (column >> 1))
+		if (a & 1)
+			v ^= column;
+	return owen_scramble(v, seed) * 0x1p-32;
 }
 
+class pixel_sampler {
+public:
+	// sample_index counts from 0 to samples_per_pixel - 1
+	pixel_sampler(int x, int y, std::size_t sample_index, std::size_t samples_per_pixel, int width, int height, sampler_type type)
+		: type(type), x(x), y(y), sample_index(sample_index), samples_per_pixel(samples_per_pixel) {
+		if (type == sampler_type::zsobol) {
+			log2_samples_per_pixel = std::bit_width(std::max<std::size_t>(samples_per_pixel, 1) - 1);
+			const int log2_resolution = std::bit_width(static_cast<unsigned>(std::max(width, height) - 1));
+			n_base4_digits = log2_resolution + (log2_samples_per_pixel + 1) / 2;
+			morton_index = (encode_morton2(x, y) << log2_samples_per_pixel) | sample_index;
+		}
+	}
+
+	double get1d() {
+		switch (type) {
+		case sampler_type::sobol: {
+			const uint64_t hash = pixel_hash();
+			++dimension;
+			return clamp_sample(sobol_sample(shuffled_index(hash), 0, static_cast<uint32_t>(hash >> 32)));
+		}
+		case sampler_type::zsobol: {
+			const uint64_t index = zsobol_index();
+			const uint64_t hash = mix_bits(static_cast<uint64_t>(++dimension) ^ seed);
+			return clamp_sample(sobol_sample(index, 0, static_cast<uint32_t>(hash)));
+		}
+		default:
+			return (independent_hash() >> 11) * 0x1p-53;
+		}
+	}
+
+	vec2 get2d() {
+		switch (type) {
+		case sampler_type::sobol: {
+			const uint64_t hash = pixel_hash();
+			const uint64_t index = shuffled_index(hash);
+			dimension += 2;
+			return vec2(clamp_sample(sobol_sample(index, 0, static_cast<uint32_t>(hash))), clamp_sample(sobol_sample(index, 1, static_cast<uint32_t>(hash >> 32))));
+		}
+		case sampler_type::zsobol: {
+			const uint64_t index = zsobol_index();
+			dimension += 2;
+			const uint64_t hash = mix_bits(static_cast<uint64_t>(dimension) ^ seed);
+			return vec2(clamp_sample(sobol_sample(index, 0, static_cast<uint32_t>(hash))), clamp_sample(sobol_sample(index, 1, static_cast<uint32_t>(hash >> 32))));
+		}
+		default: {
+			const uint64_t hash = independent_hash();
+			return vec2(clamp_sample(static_cast<uint32_t>(hash) * 0x1p-32), clamp_sample((hash >> 32) * 0x1p-32));
+		}
+		}
+	}
+
+	// A 2D sample and a 1D one after it, for the materials that need a third dimension
+	vec3 get3d() {
+		const vec2 u = get2d();
+		return vec3(u.x, u.y, clamp_sample(get1d()));
+	}
+
+private:
+	static real clamp_sample(double u) {
+		// Rounding to float could produce 1
+		return std::min(static_cast<real>(u), std::nextafter(real(1), real(0)));
+	}
+
+	uint64_t pixel_hash() const {
+		return mix_bits((static_cast<uint64_t>(x) << 40) ^ (static_cast<uint64_t>(y) << 16) ^ static_cast<uint64_t>(dimension) ^ seed);
+	}
+
+	// Counter based random numbers for the independent sampler, consumes a dimension
+	uint64_t independent_hash() {
+		return mix_bits(pixel_hash() ^ mix_bits(sample_index + (static_cast<uint64_t>(dimension++) << 32)));
+	}
+
+	// Every pixel and dimension pair walks through the Sobol points in its own order, otherwise the dimensions would be correlated
+	uint64_t shuffled_index(uint64_t hash) const {
+		return permutation_element(static_cast<uint32_t>(sample_index), static_cast<uint32_t>(samples_per_pixel), static_cast<uint32_t>(hash));
+	}
+
+	// Index of this sample in the Sobol sequence of the whole image (Ahmed and Wonka, "Screen-Space Blue-Noise
+	// Diffusion of Monte Carlo Sampling Error via Hierarchical Ordering of Pixels"): the pixels take consecutive
+	// blocks of points in Morton order, with the base 4 digits randomly permuted per dimension and level
+	uint64_t zsobol_index() const {
+		static constexpr uint8_t permutations[24][4] = {
+			{0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2},
+			{1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+			{2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1}, {2, 3, 1, 0},
+			{3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1}, {3, 0, 2, 1}, {3, 0, 1, 2} };
+
+		uint64_t index = 0;
+		// An odd power of 2 samples per pixel leaves one binary digit at the end
+		const bool odd_log2 = log2_samples_per_pixel & 1;
+		const int last_digit = odd_log2 ? 1 : 0;
+		for (int i = n_base4_digits - 1; i >= last_digit; --i) {
+			const int digit_shift = 2 * i - (odd_log2 ? 1 : 0);
+			int digit = (morton_index >> digit_shift) & 3;
+			const uint64_t higher_digits = morton_index >> (digit_shift + 2);
+			const int p = (mix_bits(higher_digits ^ (0x55555555u * static_cast<uint64_t>(dimension))) >> 24) % 24;
+			digit = permutations[p][digit];
+			index |= static_cast<uint64_t>(digit) << digit_shift;
+		}
+		if (odd_log2) {
+			const int digit = morton_index & 1;
+			index |= digit ^ (mix_bits((morton_index >> 1) ^ (0x55555555u * static_cast<uint64_t>(dimension))) & 1);
+		}
+		return index;
+	}
+
+	static constexpr uint64_t seed = 0x5bd1e995;
+	const sampler_type type;
+	const int x, y;
+	const std::size_t sample_index, samples_per_pixel;
+	int dimension = 0;
+	// zsobol only
+	int log2_samples_per_pixel = 0;
+	int n_base4_digits = 0;
+	uint64_t morton_index = 0;
+};
+
 /*
 Filter Methods
 */
@@ -59,7 +244,7 @@ Final combined method
 */
 
 const auto filter = mitchell_filter;
-const auto sampler = sample_uniform;
+const sampler_type active_sampler = sampler_type::zsobol;
 
 struct PixelSample {
     double u;
@@ -67,8 +252,9 @@ struct PixelSample {
     double weight;
 };
 
-static PixelSample sample_pixel(int x, int y, int width, int height, int sample_index) {
-	const vec3 offset = sampler(sample_index);
+// offset is a uniform sample in [0,1)^2, the first dimension of the pixel_sampler
+static PixelSample sample_pixel(int x, int y, int width, int height, const vec2& offset_sample) {
+	const vec3 offset = vec3(offset_sample.x - real(.5), offset_sample.y - real(.5), 0);
 	return PixelSample{(x + .5 + offset.x) / (width - 1.), 
 											(y + .5 + offset.y) / (height - 1.), 
 											filter(offset)};
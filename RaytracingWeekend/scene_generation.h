@@ -11,6 +11,10 @@
 
 #include "bvh.h"
 #include "fog.h"
+#include "camera.h"
+
+#include <string>
+#include <vector>
 
 
 hittable_list random_scene() {
@@ -137,6 +141,31 @@ hittable_list glass_box_and_sphere() {
 }
 
 
+hittable_list thinfilm_spheres() {
+    hittable_list world;
+
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    // Soap bubble, coated glass and a double coating, film thicknesses in nm
+    auto bubble = make_shared<thinfilm>(color(1, 1, 1), 500, 1.33);
+    world.add(make_shared<sphere>(point3(-2.2, 1, 0), 1, bubble));
+
+    auto glass = make_shared<dielectric>(color(1, 1, 1), 1.5);
+    auto coated_glass = make_shared<thinfilm>(color(1, 1, 1), 350, 1.38, glass);
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1, coated_glass));
+
+    auto inner_coating = make_shared<thinfilm>(color(1, 1, 1), 250, 2.0, make_shared<dielectric>(color(1, 1, 1), 1.5));
+    auto double_coated = make_shared<thinfilm>(color(1, 1, 1), 400, 1.38, inner_coating);
+    world.add(make_shared<sphere>(point3(2.2, 1, 0), 1, double_coated));
+
+    auto difflight = make_shared<emissive>(color(15, 15, 15));
+    world.add(make_shared<xz_rect>(-2, 2, -3, -1, 4, difflight));
+
+    return world;
+}
+
+
 hittable_list glass_box_and_sphere2() {
     hittable_list world;
 
@@ -176,9 +205,7 @@ hittable_list caustics() {
     auto difflight = make_shared<emissive>(color(50, 50, 50));
     world.add(make_shared<sphere>(point3(-2.2,2.2,.5),.2, difflight));
 
-    auto glassObj = obj("susan2.obj", prismGlass);
-    bvh_node mesh_node = bvh_node(glassObj);
-    world.add(make_shared<bvh_node>(mesh_node));
+    world.add(obj("susan2.obj", prismGlass));
 
     return world;
 }
@@ -314,4 +341,35 @@ hittable_list final_scene() {
     }
 
     return objects;
-}
\ No newline at end of file
+}
+
+// The built-in scenes by name, with a camera that frames them. Used by the command line of RaytracingWeekend.cpp and
+// the benchmarks.
+struct scene_description {
+    const char* name;
+    hittable_list (*build)();
+    camera_settings camset;
+};
+
+inline const std::vector<scene_description>& builtin_scenes() {
+    static const std::vector<scene_description> scenes = {
+        { "random", random_scene, { {13, 6, 0}, {0, 0, 0} } },
+        { "cornell", cornell, { {278, 278, -800}, {278, 278, 0}, 40 } },
+        { "glass_box_and_sphere", glass_box_and_sphere, { {13, 6, 0}, {0, 0, 0} } },
+        { "glass_box_and_sphere2", glass_box_and_sphere2, { {13, 6, 0}, {0, 0, 0} } },
+        { "thinfilm_spheres", thinfilm_spheres, { {0, 2, 8}, {0, 1, 0}, 40 } },
+        { "caustics", caustics, { {13, 6, 0}, {0, 0, 0} } },
+        { "horse", horse_scene, { {13, 2, 3}, {0, 0, 0} } },
+        { "glass_cubes", glass_cubes, { {13, 6, 0}, {0, 0, 0} } },
+        { "final", final_scene, { {478, 278, -600}, {278, 278, 0}, 40 } },
+    };
+    return scenes;
+}
+
+// nullptr if there is no scene of that name
+inline const scene_description* find_scene(const std::string& name) {
+    for (const auto& scene : builtin_scenes())
+        if (name == scene.name)
+            return &scene;
+    return nullptr;
+}
@@ -1,5 +1,13 @@
 #pragma once
 #include "rtweekend.h"
+
+#include <array>
+#include <map>
+#include <mutex>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 typedef vec3 color;
 typedef vec3 normal3;
 
@@ -11,14 +19,14 @@ According GitHub code:
 https://github.com/mmp/pbrt-v3/blob/aaa552a4b9cbf9dccb71450f47b268e0ed6370e2/src/core/spectrum.cpp
 */
 
-const size_t nCIESamples = 471;
-const double lambda_start = 360;
-const double lambda_end = lambda_start + nCIESamples;
-const double white_wavelength = (lambda_end + lambda_start) / 2.0;
+constexpr size_t nCIESamples = 471;
+constexpr double lambda_start = 360;
+constexpr double lambda_end = lambda_start + nCIESamples;
+constexpr double white_wavelength = (lambda_end + lambda_start) / 2.0;
 
 #pragma region CIE_LUTs
 
-const double CIE_X[nCIESamples] = {
+constexpr double CIE_X[nCIESamples] = {
     // CIE X unction values
     0.0001299000,   0.0001458470,   0.0001638021,   0.0001840037,
     0.0002066902,   0.0002321000,   0.0002607280,   0.0002930750,
@@ -139,7 +147,7 @@ const double CIE_X[nCIESamples] = {
     0.000001905497, 0.000001776509, 0.000001656215, 0.000001544022,
     0.000001439440, 0.000001341977, 0.000001251141 };
 
-const double CIE_Y[nCIESamples] = {
+constexpr double CIE_Y[nCIESamples] = {
     // CIE Y unction values
     0.000003917000,  0.000004393581,  0.000004929604,  0.000005532136,
     0.000006208245,  0.000006965000,  0.000007813219,  0.000008767336,
@@ -260,7 +268,7 @@ const double CIE_Y[nCIESamples] = {
     0.0000006881098, 0.0000006415300, 0.0000005980895, 0.0000005575746,
     0.0000005198080, 0.0000004846123, 0.0000004518100 };
 
-const double CIE_Z[nCIESamples] = {
+constexpr double CIE_Z[nCIESamples] = {
     // CIE Z unction values
     0.0006061000,
     0.0006808792,
@@ -771,11 +779,11 @@ const double CIE_lambda[nCIESamples] = {
 #pragma endregion
 
 color XYZToRGB(const color& xyz) {
-    color rgb{
+    color rgb(
         3.240479 * xyz[0] - 1.537150 * xyz[1] - 0.498535 * xyz[2],
         -0.969256 * xyz[0] + 1.875991 * xyz[1] + 0.041556 * xyz[2],
         0.055648 * xyz[0] - 0.204043 * xyz[1] + 1.057311 * xyz[2]
-    };
+    );
     return rgb;
 }
 
@@ -817,17 +825,86 @@ double luminance(color c) {
     return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
 }
 
+// The CIE curves converted to linear sRGB at compile time, as floats padded to 4 so that an entry is a single SIMD load.
+// Interpolating the RGB entries gives the same result as interpolating XYZ and converting afterwards.
+struct alignas(16) rgb_entry {
+    float r, g, b, pad;
+};
+
+constexpr std::array<rgb_entry, nCIESamples> cie_rgb_table = [] {
+    std::array<rgb_entry, nCIESamples> table{};
+    for (size_t i = 0; i < nCIESamples; i++) {
+        table[i] = {
+            static_cast<float>(3.240479 * CIE_X[i] - 1.537150 * CIE_Y[i] - 0.498535 * CIE_Z[i]),
+            static_cast<float>(-0.969256 * CIE_X[i] + 1.875991 * CIE_Y[i] + 0.041556 * CIE_Z[i]),
+            static_cast<float>(0.055648 * CIE_X[i] - 0.204043 * CIE_Y[i] + 1.057311 * CIE_Z[i]),
+            0 };
+    }
+    return table;
+}();
+
+// Table entry below the wavelength and the interpolation factor towards the next one
+inline size_t rgb_table_index(double wavelength, float& t) {
+    const double offset = std::clamp(wavelength - lambda_start, 0.0, static_cast<double>(nCIESamples - 1));
+    const size_t index = std::min(static_cast<size_t>(offset), nCIESamples - 2);
+    t = static_cast<float>(offset - index);
+    return index;
+}
+
 color lambda_to_rgb(double wavelength) {
-    auto xyz = lambda_to_xyz(wavelength);
-    return  XYZToRGB(xyz);
+    float t;
+    const size_t index = rgb_table_index(wavelength, t);
+    const rgb_entry& a = cie_rgb_table[index];
+    const rgb_entry& b = cie_rgb_table[index + 1];
+    return color(a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t, a.b + (b.b - a.b) * t);
 }
 
-double wien_displacement_law(double temperature) {
+// Smits' RGB to spectrum conversion ("An RGB-to-Spectrum Conversion for Reflectances", 1999): a color is white plus at
+// most one of cyan, magenta, yellow and one of red, green, blue, each of them a spectrum over 10 bins from 380 to 720nm.
+enum smits_basis { smits_white, smits_cyan, smits_magenta, smits_yellow, smits_red, smits_green, smits_blue, smits_basis_count };
+
+constexpr int smits_bins = 10;
+constexpr double smits_lambda_start = 380;
+constexpr double smits_lambda_end = 720;
+
+constexpr float smits_spectra[smits_basis_count][smits_bins] = {
+    { 1.0000, 1.0000, 0.9999, 0.9993, 0.9992, 0.9998, 1.0000, 1.0000, 1.0000, 1.0000 }, // white
+    { 0.9710, 0.9426, 1.0007, 1.0007, 1.0007, 1.0007, 0.1564, 0.0000, 0.0000, 0.0000 }, // cyan
+    { 1.0000, 1.0000, 0.9685, 0.2229, 0.0000, 0.0458, 0.8369, 1.0000, 1.0000, 0.9959 }, // magenta
+    { 0.0001, 0.0000, 0.1088, 0.6651, 1.0000, 1.0000, 0.9996, 0.9586, 0.9685, 0.9840 }, // yellow
+    { 0.1012, 0.0515, 0.0000, 0.0000, 0.0000, 0.0000, 0.8325, 1.0149, 1.0149, 1.0149 }, // red
+    { 0.0000, 0.0000, 0.0273, 0.7937, 1.0000, 0.9418, 0.1719, 0.0000, 0.0000, 0.0025 }, // green
+    { 1.0000, 1.0000, 0.8916, 0.3323, 0.0000, 0.0000, 0.0003, 0.0369, 0.0483, 0.0496 }, // blue
+};
+
+// Bin of the Smits spectra, wavelengths outside of 380-720nm continue the first and last bin
+inline int smits_bin(double wavelength) {
+    const double bin = (wavelength - smits_lambda_start) * (smits_bins / (smits_lambda_end - smits_lambda_start));
+    return std::clamp(static_cast<int>(bin), 0, smits_bins - 1);
+}
+
+constexpr double wien_displacement_law(double temperature) {
     return 2.897771955e6/temperature;//2.897771955e-3 K m -> 2.897771955e6 K nm
 }
 
-// TODO: This should be constexpr
-double plancks_law(const double wavelength, const double temperature) {
+// exp for constant evaluation (std::exp isn't constexpr): e^x = 2^k * e^r with |r| <= ln(2)/2, and a Taylor series for e^r
+constexpr double constexpr_exp(double x) {
+    constexpr double ln2 = std::numbers::ln2_v<double>;
+    const long long k = static_cast<long long>(x / ln2 + (x < 0 ? -0.5 : 0.5));
+    const double r = x - k * ln2;
+    double term = 1, sum = 1;
+    for (int n = 1; n < 20; n++) {
+        term *= r / n;
+        sum += term;
+    }
+    for (long long i = 0; i < k; i++)
+        sum *= 2;
+    for (long long i = 0; i > k; i--)
+        sum /= 2;
+    return sum;
+}
+
+constexpr double plancks_law(const double wavelength, const double temperature) {
     //return the spectral intensity at a given wavelength
     constexpr double h = 6.626e-34 * 1e9;//correction for nm
     constexpr double kb = 1.381e-23;
@@ -839,27 +916,191 @@ double plancks_law(const double wavelength, const double temperature) {
     auto pow2 = wavelength * wavelength * 1e-12;
     auto pow4 = pow2 * pow2;
 
-    return numerator / (pow4 * wavelength * (std::exp(expo / wavelength / temperature) - 1));
+    const double exponent = expo / wavelength / temperature;
+    const double e = std::is_constant_evaluated() ? constexpr_exp(exponent) : std::exp(exponent);
+    return numerator / (pow4 * wavelength * (e - 1));
 }
 
-inline std::pair<double ,double> random_wavelength(std::size_t current, std::size_t seq_length) {
-    // Generate wavelengths distributed according to planck using the rejection method
-    // TODO: this should be constexpr
-    const double temperature = 6800.0;
-    auto max_intensity = plancks_law(wien_displacement_law(temperature), temperature);
+// Inverse CDF sampling of a black body spectrum over the CIE range. The spectrum is tabulated per nm like the CIE
+// tables (piecewise constant, at the center of every nm), so the samples follow it exactly and need no weight.
+class planck_distribution {
+public:
+    constexpr planck_distribution(double temperature) : temperature(temperature) {
+        cdf[0] = 0;
+        for (size_t i = 0; i < nCIESamples; i++)
+            cdf[i + 1] = cdf[i] + plancks_law(lambda_start + i + 0.5, temperature);
+        const double total = cdf[nCIESamples];
+        for (size_t i = 0; i < nCIESamples; i++) {
+            cdf[i + 1] /= total;
+            inverse_mass[i] = 1 / (cdf[i + 1] - cdf[i]);
+        }
+        cdf[nCIESamples] = 1;
+
+        // guide[g] is the last bin that starts at or before u = g / guide_size
+        size_t bin = 0;
+        for (size_t g = 0; g <= guide_size; g++) {
+            while (bin + 1 < nCIESamples && cdf[bin + 1] <= static_cast<double>(g) / guide_size)
+                bin++;
+            if (g < guide_size)
+                guide[g] = static_cast<uint16_t>(bin);
+            if (g > 0)
+                guide_steps = std::max(guide_steps, static_cast<int>(bin - guide[g - 1]));
+        }
+    }
 
-    auto lambda = random_double(lambda_start, lambda_end); // replace by sobol sequence
-    auto intensity = random_double(0, max_intensity);
+    // Maps a uniform u in [0, 1) to a wavelength, monotonically, so stratified u give stratified wavelengths. The guide
+    // table points to the bin at the start of u's interval, at most guide_steps further bins start within it (one for
+    // the 6800K spectrum). The steps don't branch on u, they compile to a compare and an add.
+    constexpr double sample(double u) const {
+        size_t bin = guide[static_cast<size_t>(u * guide_size)];
+        for (int i = 0; i < guide_steps; i++)
+            bin += cdf[bin + 1] <= u;
+        return lambda_start + bin + (u - cdf[bin]) * inverse_mass[bin];
+    }
 
-    // Generate new samples until one falls within the pdf
-    while (intensity > plancks_law(lambda, temperature)) {
-        lambda = random_double(lambda_start, lambda_end);
-        intensity = random_double(0, max_intensity);
+    // Probability density of sample() per nm
+    constexpr double pdf(double wavelength) const {
+        const size_t i = std::min(static_cast<size_t>(std::max(wavelength - lambda_start, 0.0)), nCIESamples - 1);
+        return 1 / inverse_mass[i];
     }
-    return std::make_pair(lambda, 1);
 
-    // Alternatively: go through all wavelengths in regular intervals
-    // Then the samples must be weighted by plancks_law(lambda, temperature)/plancks_law(wien_displacement_law(temperature), temperature) at the end
-    lambda = glm::mix(lambda_start, lambda_end, static_cast<double>(current) / static_cast<double>(seq_length));
-    return std::make_pair(lambda, plancks_law(lambda, temperature) / max_intensity);
+    // The table for one temperature, built on first use and shared by all threads. The sun-like 6800K table of the
+    // renderer is built at compile time.
+    static const planck_distribution& get(double temperature);
+
+    double temperature;
+
+private:
+    static constexpr size_t guide_size = 1024;
+
+    std::array<double, nCIESamples + 1> cdf{};
+    std::array<double, nCIESamples> inverse_mass{};
+    std::array<uint16_t, guide_size> guide{};
+    int guide_steps = 0;
+};
+
+constexpr double default_temperature = 6800.0;
+constexpr planck_distribution default_planck_distribution(default_temperature);
+
+inline const planck_distribution& planck_distribution::get(double temperature) {
+    if (temperature == default_temperature)
+        return default_planck_distribution;
+
+    static std::mutex mutex;
+    static std::map<double, std::unique_ptr<planck_distribution>> cache;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& table = cache[temperature];
+    if (!table)
+        table = std::make_unique<planck_distribution>(temperature);
+    return *table;
+}
+
+inline std::pair<double ,double> random_wavelength(double u, double temperature = default_temperature) {
+    // Wavelength distributed according to planck, and its weight
+    return std::make_pair(planck_distribution::get(temperature).sample(u), 1);
+}
+
+// Hero wavelength sampling (Wilkie et al. 2014, "Hero Wavelength Spectral Sampling"): every path carries several
+// wavelengths, the hero one is on the ray and the others are spread evenly over the range from it. Surfaces that don't
+// depend on the wavelength account for all of them at once, the first dispersive one keeps only the hero.
+constexpr int hero_wavelength_count = 4;
+
+// One value per carried wavelength
+#ifdef SINGLE_PRECISION
+typedef glm::highp_vec4 wavelength_values;
+#else
+typedef glm::highp_dvec4 wavelength_values;
+#endif
+static_assert(hero_wavelength_count == 4, "wavelength_values holds one value per hero wavelength");
+
+struct sampled_wavelengths {
+    double lambda[hero_wavelength_count];
+    wavelength_values basis[smits_basis_count]; // the Smits spectra at the carried wavelengths
+
+    double hero() const { return lambda[0]; }
+
+    // An RGB reflectance (or emission) at the carried wavelengths
+    wavelength_values upsample(const color& rgb) const {
+        const real r = rgb.x, g = rgb.y, b = rgb.z;
+        if (r <= g && r <= b)
+            return r * basis[smits_white] + (g <= b ? (g - r) * basis[smits_cyan] + (b - g) * basis[smits_blue]
+                                                    : (b - r) * basis[smits_cyan] + (g - b) * basis[smits_green]);
+        if (g <= r && g <= b)
+            return g * basis[smits_white] + (r <= b ? (r - g) * basis[smits_magenta] + (b - r) * basis[smits_blue]
+                                                    : (b - g) * basis[smits_magenta] + (r - b) * basis[smits_red]);
+        return b * basis[smits_white] + (r <= g ? (r - b) * basis[smits_yellow] + (g - r) * basis[smits_green]
+                                                : (g - b) * basis[smits_yellow] + (r - g) * basis[smits_red]);
+    }
+};
+
+// u places the hero wavelength, the others follow at equal spacing in the CDF of the Planck spectrum (wrapping around),
+// so the wavelengths of a path are stratified and each of them is distributed like the spectrum.
+inline sampled_wavelengths sample_wavelengths(double u, const planck_distribution& spectrum = default_planck_distribution) {
+    sampled_wavelengths wavelengths;
+    for (int i = 0; i < hero_wavelength_count; i++) {
+        const double ui = u + static_cast<double>(i) / hero_wavelength_count;
+        wavelengths.lambda[i] = spectrum.sample(ui - (ui >= 1));
+
+        const int bin = smits_bin(wavelengths.lambda[i]);
+        for (int k = 0; k < smits_basis_count; k++)
+            wavelengths.basis[k][i] = smits_spectra[k][bin];
+    }
+    return wavelengths;
+}
+
+// Color of the values carried for the wavelengths: the average of the wavelengths' colors weighted by their values.
+// The wavelengths are distributed like the emitted spectrum, so they need no further weight.
+inline color wavelengths_to_rgb(const sampled_wavelengths& wavelengths, const wavelength_values& values) {
+#if defined(__SSE2__) || defined(_M_X64)
+    // Every table entry is one 4 float register (r, g, b, 0)
+    __m128 sum = _mm_setzero_ps();
+    for (int i = 0; i < hero_wavelength_count; i++) {
+        float t;
+        const size_t index = rgb_table_index(wavelengths.lambda[i], t);
+        const __m128 a = _mm_load_ps(&cie_rgb_table[index].r);
+        const __m128 b = _mm_load_ps(&cie_rgb_table[index + 1].r);
+        const __m128 rgb = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_set1_ps(t)));
+        sum = _mm_add_ps(sum, _mm_mul_ps(rgb, _mm_set1_ps(static_cast<float>(values[i]))));
+    }
+    alignas(16) float rgb[4];
+    _mm_store_ps(rgb, sum);
+    return color(rgb[0], rgb[1], rgb[2]) / real(hero_wavelength_count);
+#else
+    color rgb(0, 0, 0);
+    for (int i = 0; i < hero_wavelength_count; i++)
+        rgb += lambda_to_rgb(wavelengths.lambda[i]) * values[i];
+    return rgb / real(hero_wavelength_count);
+#endif
+}
+
+// Radiance and throughput along a path: RGB, or with DISPERSION one value per carried wavelength. RGB colors of
+// materials and emitters enter the path through to_path_color.
+#ifdef DISPERSION
+typedef wavelength_values path_color;
+
+inline path_color to_path_color(const color& rgb, const sampled_wavelengths* wavelengths) {
+    return wavelengths->upsample(rgb);
+}
+
+inline color path_color_to_rgb(const path_color& c, const sampled_wavelengths* wavelengths) {
+    return wavelengths_to_rgb(*wavelengths, c);
+}
+
+inline real max_component(const path_color& c) {
+    return std::max(std::max(c.x, c.y), std::max(c.z, c.w));
+}
+#else
+typedef color path_color;
+
+inline path_color to_path_color(const color& rgb, const sampled_wavelengths*) {
+    return rgb;
+}
+
+inline color path_color_to_rgb(const path_color& c, const sampled_wavelengths*) {
+    return c;
+}
+
+inline real max_component(const path_color& c) {
+    return std::max(c.x, std::max(c.y, c.z));
 }
+#endif
@@ -1,18 +1,22 @@
 #pragma once
 #include "hittable.h"
+#include "onb.h"
 
-class sphere : public hittable
+class sphere final : public hittable
 {
 public:
     sphere() : radius(0.), center({ 0,0,0 }) {};
-	sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
+	sphere(point3 cen, real r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
     virtual bool bounding_box(aabb& output_box) const override;
+    virtual real pdf_value(const point3& origin, const vec3& v) const override;
+    virtual vec3 random(const point3& origin, const vec2& u) const override;
 
 public:
 	point3 center;
-	double radius;
+	real radius;
     shared_ptr<material> mat_ptr;
 };
 
@@ -24,17 +28,17 @@ bool sphere::bounding_box(aabb& output_box) const {
     return true;
 }
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     const vec3 oc = r.origin() - center;
-    const double a = glm::length2(r.direction());
-    const double half_b = dot(r.direction(), oc);
-    const double c = glm::length2(oc) - radius * radius;
+    const real a = glm::length2(r.direction());
+    const real half_b = dot(r.direction(), oc);
+    const real c = glm::length2(oc) - radius * radius;
 
-    const double discriminant = half_b * half_b - a * c;
+    const real discriminant = half_b * half_b - a * c;
     if (discriminant < 0) 
         return false;
 
-    double root = (-half_b - sqrt(discriminant)) / a;
+    real root = (-half_b - sqrt(discriminant)) / a;
     if (root < t_min || root > t_max) {
         root = (-half_b + sqrt(discriminant)) / a;
         if (root < t_min || root > t_max) {
@@ -49,4 +53,55 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     rec.mat_ptr = mat_ptr.get();
 
     return true;
+}
+
+bool sphere::occluded(const ray& r, real t_min, real t_max) const {
+    const vec3 oc = r.origin() - center;
+    const real a = glm::length2(r.direction());
+    const real half_b = dot(r.direction(), oc);
+    const real c = glm::length2(oc) - radius * radius;
+
+    const real discriminant = half_b * half_b - a * c;
+    if (discriminant < 0)
+        return false;
+
+    // Either root in range blocks the ray, no need to find out which one is closer
+    const real sqrtd = sqrt(discriminant);
+    const real near_root = (-half_b - sqrtd) / a;
+    const real far_root = (-half_b + sqrtd) / a;
+    return (near_root >= t_min && near_root <= t_max) || (far_root >= t_min && far_root <= t_max);
+}
+
+// Uniform direction inside the cone around z that a sphere of the given radius subtends at distance sqrt(distance_squared)
+inline vec3 random_to_sphere(real radius, real distance_squared, const vec2& u) {
+    const real r1 = u.x;
+    const real r2 = u.y;
+    const real z = 1 + r2 * (std::sqrt(1 - radius * radius / distance_squared) - 1);
+
+    const real phi = 2 * pi * r1;
+    const real sin_theta = std::sqrt(1 - z * z);
+    return vec3(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, z);
+}
+
+real sphere::pdf_value(const point3& origin, const vec3& v) const {
+    const real distance_squared = glm::length2(center - origin);
+    if (distance_squared <= radius * radius)
+        return real(1 / (4 * pi)); // inside the sphere every direction hits it, random() samples them uniformly
+
+    hit_record rec;
+    if (!this->hit(ray(origin, v, white_wavelength), global_t_min, infinity, rec))
+        return 0;
+
+    // Sampled uniformly over the solid angle of the visible cap
+    const real cos_theta_max = std::sqrt(1 - radius * radius / distance_squared);
+    const real solid_angle = 2 * pi * (1 - cos_theta_max);
+    return 1 / solid_angle;
+}
+
+vec3 sphere::random(const point3& origin, const vec2& u) const {
+    const vec3 direction = center - origin;
+    const real distance_squared = glm::length2(direction);
+    if (distance_squared <= radius * radius)
+        return sample_uniform_sphere(u);
+    return onb(direction).local(random_to_sphere(radius, distance_squared, u));
 }
\ No newline at end of file
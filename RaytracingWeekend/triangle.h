@@ -2,7 +2,7 @@
 #include "rtweekend.h"
 #include "hittable.h"
 
-class triangle : public hittable {
+class triangle final : public hittable {
 public:
     triangle(point3 p0, point3 p1, point3 p2, shared_ptr<material> m) :v0(p0), v0v1(p1 - p0), v0v2(p2 - p0), mat_ptr(m) {
         outward_normal = glm::normalize(cross(v0v1, v0v2));
@@ -16,8 +16,11 @@ public:
         outward_normal = glm::normalize(normal);
     }
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 	virtual bool bounding_box(aabb& output_box) const override;
+    virtual real pdf_value(const point3& origin, const vec3& v) const override;
+    virtual vec3 random(const point3& origin, const vec2& u) const override;
 private:
     point3 v0;
     vec3 v0v1;
@@ -29,30 +32,38 @@ public:
 };
 
 // #define CULLING
-//Mller Trumbore ray triangle intersection algorithm 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+//Mller Trumbore ray triangle intersection algorithm, shared by triangle and triangle_mesh
+inline bool intersect_triangle(const point3& v0, const vec3& v0v1, const vec3& v0v2, const ray& r, real t_min, real t_max, real& t) {
     auto pvec = cross(r.direction(), v0v2);
-    double det = dot(v0v1, pvec);
+    real det = dot(v0v1, pvec);
     
     #ifdef CULLING 
-    if (!rec.front_face) return false; // Hit backface -> cull
+    if (det <= 0) return false; // Hit backface -> cull
+    #elif defined(SINGLE_PRECISION)
+    if (det == 0) return false; // parallel rays, t_min is 0 for offset ray origins
     #else 
     if (fabs(det) < t_min) return false; // parallel rays
     #endif 
 
-    double iDeterminant = 1. / det;
+    real iDeterminant = 1. / det;
 
     vec3 tvec = r.origin() - v0;
-    double u = dot(tvec, pvec) * iDeterminant;
+    real u = dot(tvec, pvec) * iDeterminant;
     if (u < 0 || u > 1) return false;
 
     vec3 qvec = cross(tvec, v0v1);
-    double v = dot(r.direction(), qvec) * iDeterminant;
+    real v = dot(r.direction(), qvec) * iDeterminant;
     if (v < 0 || u + v > 1) return false;
 
-    rec.t = dot(v0v2, qvec) * iDeterminant;
-    if (rec.t<t_min || rec.t > t_max) return false;
+    t = dot(v0v2, qvec) * iDeterminant;
+    return t >= t_min && t <= t_max;
+}
+
+bool triangle::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    real t;
+    if (!intersect_triangle(v0, v0v1, v0v2, r, t_min, t_max, t)) return false;
 
+    rec.t = t;
     rec.p = r.at(rec.t);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mat_ptr.get();
@@ -60,8 +71,32 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     return true;
 }
 
+bool triangle::occluded(const ray& r, real t_min, real t_max) const {
+    real t;
+    return intersect_triangle(v0, v0v1, v0v2, r, t_min, t_max, t);
+}
+
 bool triangle::bounding_box(aabb& output_box) const {
 	output_box = precomputed_bounds;
 	return true;
 }
 
+real triangle::pdf_value(const point3& origin, const vec3& v) const {
+    real t;
+    if (!intersect_triangle(v0, v0v1, v0v2, ray(origin, v, white_wavelength), global_t_min, infinity, t))
+        return 0;
+
+    const vec3 n = cross(v0v1, v0v2); // length is twice the area
+    const real area = real(0.5) * glm::length(n);
+    const real distance_squared = t * t * glm::length2(v);
+    const real cosine = std::fabs(dot(v, n)) / (glm::length(v) * glm::length(n));
+    return distance_squared / (cosine * area);
+}
+
+vec3 triangle::random(const point3& origin, const vec2& u) const {
+    // Uniform point on the triangle, the square root keeps the barycentric density uniform over the area
+    const real su = std::sqrt(u.x);
+    const real b1 = 1 - su;
+    const real b2 = u.y * su;
+    return v0 + b1 * v0v1 + b2 * v0v2 - origin;
+}
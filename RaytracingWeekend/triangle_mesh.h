@@ -0,0 +1,85 @@
+#pragma once
+#include "rtweekend.h"
+#include "hittable.h"
+#include "triangle.h"
+#include "bvh.h"
+
+// Indexed triangle mesh: the vertices and normals are stored once and shared between the triangles,
+// a triangle only costs its three vertex indices and one normal index. The triangles are not visible
+// to the scene BVH, the mesh builds its own bvh_tree over them instead.
+class triangle_mesh : public hittable {
+public:
+    triangle_mesh() {}
+    // indices holds three vertex indices per triangle. normal_indices holds one index into normals per
+    // triangle (the flat shading normal), if it is empty the geometric normal is used.
+    triangle_mesh(std::vector<point3> vertices, std::vector<uint32_t> indices, std::vector<vec3> normals, std::vector<uint32_t> normal_indices,
+        shared_ptr<material> m, int num_threads = default_thread_count())
+        : vertices(std::move(vertices)), normals(std::move(normals)), indices(std::move(indices)), normal_indices(std::move(normal_indices)), mat_ptr(m) {
+        tree = bvh_tree(triangle_count(), [this](size_t i) {
+            const point3& p0 = vertex(i, 0), & p1 = vertex(i, 1), & p2 = vertex(i, 2);
+            return aabb(glm::min(glm::min(p0, p1), p2), glm::max(glm::max(p0, p1), p2));
+        }, bvh_split_method::binned_sah, num_threads);
+
+        // Reorder the triangles to match the leaves of the tree
+        const auto order = tree.take_primitive_order();
+        std::vector<uint32_t> ordered_indices(this->indices.size());
+        std::vector<uint32_t> ordered_normal_indices(this->normal_indices.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            for (int k = 0; k < 3; k++)
+                ordered_indices[3 * i + k] = this->indices[3 * order[i] + k];
+            if (!ordered_normal_indices.empty())
+                ordered_normal_indices[i] = this->normal_indices[order[i]];
+        }
+        this->indices = std::move(ordered_indices);
+        this->normal_indices = std::move(ordered_normal_indices);
+    }
+
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+        return tree.hit(r, t_min, t_max, rec, [this](uint32_t i, const ray& r, real t_min, real t_max, hit_record& rec) {
+            const point3& p0 = vertex(i, 0);
+            const vec3 v0v1 = vertex(i, 1) - p0;
+            const vec3 v0v2 = vertex(i, 2) - p0;
+            real t;
+            if (!intersect_triangle(p0, v0v1, v0v2, r, t_min, t_max, t)) return false;
+
+            rec.t = t;
+            rec.p = r.at(rec.t);
+            rec.set_face_normal(r, glm::normalize(normal_indices.empty() ? cross(v0v1, v0v2) : normals[normal_indices[i]]));
+            rec.mat_ptr = mat_ptr.get();
+            return true;
+        });
+    }
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+        return tree.occluded(r, t_min, t_max, [this](uint32_t i, const ray& r, real t_min, real t_max) {
+            const point3& p0 = vertex(i, 0);
+            real t;
+            return intersect_triangle(p0, vertex(i, 1) - p0, vertex(i, 2) - p0, r, t_min, t_max, t);
+        });
+    }
+
+    virtual bool bounding_box(aabb& output_box) const override {
+        if (tree.empty())
+            return false;
+        output_box = tree.bounds();
+        return true;
+    }
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    size_t memory_usage() const {
+        return vertices.size() * sizeof(point3) + normals.size() * sizeof(vec3)
+            + (indices.size() + normal_indices.size()) * sizeof(uint32_t) + tree.memory_usage();
+    }
+
+private:
+    const point3& vertex(size_t triangle, int corner) const { return vertices[indices[3 * triangle + corner]]; }
+
+    std::vector<point3> vertices;
+    std::vector<vec3> normals;
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> normal_indices;
+    bvh_tree tree;
+public:
+    shared_ptr<material> mat_ptr;
+};
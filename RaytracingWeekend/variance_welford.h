@@ -41,6 +41,8 @@ private:
 
 template<class T> 
 class weighted_variance_welford{
+    // Weights are accumulated in double, the sample type decides the precision of the moments
+    typedef typename T::value_type scalar;
 public:
     weighted_variance_welford() : weight_sum(0), m_mean(), m_sum2() {}
     weighted_variance_welford(T m_initial) : weight_sum(0), m_mean(m_initial), m_sum2(m_initial) {}
@@ -48,9 +50,9 @@ public:
     void add_sample(const T& x, double weight) {
         weight_sum += weight;
         T delta = x - m_mean;
-        m_mean += (weight/weight_sum)*delta;
+        m_mean += scalar(weight/weight_sum)*delta;
         T new_delta = x - m_mean;
-        m_sum2 += weight * delta * new_delta;
+        m_sum2 += scalar(weight) * delta * new_delta;
     }
 
     T mean() const {
@@ -60,7 +62,7 @@ public:
     T variance() const {
         if(weight_sum <= 1)
           return T();
-        return m_sum2 / (weight_sum - 1);
+        return m_sum2 / scalar(weight_sum - 1);
     }
 
     T standard_deviation() const {
@@ -68,7 +70,7 @@ public:
     }
 
     T convergence() const {
-        return 1.96*sqrt(variance()/weight_sum); //https://cs184.eecs.berkeley.edu/sp23/docs/proj3-1-part-5
+        return scalar(1.96)*sqrt(variance()/scalar(weight_sum)); //https://cs184.eecs.berkeley.edu/sp23/docs/proj3-1-part-5
     }
 
     double get_weight_sum() const {
@@ -76,7 +78,7 @@ public:
     }
 
     void override_variance(T new_variance) {
-        m_sum2 = new_variance * (weight_sum - 1);
+        m_sum2 = new_variance * scalar(weight_sum - 1);
     }
 private:
   T m_mean, m_sum2;
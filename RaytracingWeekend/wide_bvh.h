@@ -0,0 +1,130 @@
+#pragma once
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <limits>
+
+// Width of the collapsed BVH that is used for traversal. Every node stores the bounds of up to BVH_WIDTH
+// children, which are tested against a ray in one SIMD slab test: 8 lanes with AVX2, 4 with SSE/NEON.
+// BVH_WIDTH 2 disables the collapse and traverses the binary BVH directly.
+#ifndef BVH_WIDTH
+#if defined(__AVX2__)
+#define BVH_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || defined(__ARM_NEON)
+#define BVH_WIDTH 4
+#else
+#define BVH_WIDTH 2
+#endif
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+template<int W>
+struct alignas(32) wide_bvh_node {
+    // Structure of arrays, bounds[0] are the minima and bounds[1] the maxima of the children per axis
+    float bounds[2][3][W];
+    uint32_t child[W]; // index of the child node, or the offset of the first primitive for leaf children
+    uint16_t count[W]; // number of primitives of leaf children, 0 for interior children
+
+    wide_bvh_node() {
+        // Empty slots get inverted bounds, which the slab test below never reports as hit
+        for (int i = 0; i < W; i++) {
+            for (int a = 0; a < 3; a++) {
+                bounds[0][a][i] = std::numeric_limits<float>::infinity();
+                bounds[1][a][i] = -std::numeric_limits<float>::infinity();
+            }
+            child[i] = 0;
+            count[i] = 0;
+        }
+    }
+};
+
+// Ray data in the precision of the node bounds, precomputed once per traversal
+struct bvh_ray {
+    float origin[3];
+    float inv_dir[3];
+    int dir_is_neg[3];
+
+    bvh_ray(const ray& r) {
+        const vec3 inv = r.invdir();
+        for (int a = 0; a < 3; a++) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = static_cast<float>(inv[a]);
+            dir_is_neg[a] = inv[a] < 0;
+        }
+    }
+};
+
+// Slab test of the ray against all children of the node. Returns a bit mask of the children that were hit
+// and stores the entry distances in t_near. The near plane is picked by the sign of the direction, so
+// empty slots (inverted bounds) always miss.
+template<int W>
+inline int intersect_wide_node(const wide_bvh_node<W>& node, const bvh_ray& r, float t_min, float t_max, float t_near[W]) {
+#if defined(__AVX2__)
+    if constexpr (W == 8) {
+        __m256 near_t = _mm256_set1_ps(t_min);
+        __m256 far_t = _mm256_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            const __m256 o = _mm256_set1_ps(r.origin[a]);
+            const __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+            const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.dir_is_neg[a]][a]), o), inv);
+            const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - r.dir_is_neg[a]][a]), o), inv);
+            near_t = _mm256_max_ps(t0, near_t);
+            far_t = _mm256_min_ps(t1, far_t);
+        }
+        _mm256_store_ps(t_near, near_t);
+        return _mm256_movemask_ps(_mm256_cmp_ps(near_t, far_t, _CMP_LE_OQ));
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    if constexpr (W == 4) {
+        __m128 near_t = _mm_set1_ps(t_min);
+        __m128 far_t = _mm_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            const __m128 o = _mm_set1_ps(r.origin[a]);
+            const __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.dir_is_neg[a]][a]), o), inv);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - r.dir_is_neg[a]][a]), o), inv);
+            near_t = _mm_max_ps(t0, near_t);
+            far_t = _mm_min_ps(t1, far_t);
+        }
+        _mm_store_ps(t_near, near_t);
+        return _mm_movemask_ps(_mm_cmple_ps(near_t, far_t));
+    }
+#elif defined(__ARM_NEON)
+    if constexpr (W == 4) {
+        float32x4_t near_t = vdupq_n_f32(t_min);
+        float32x4_t far_t = vdupq_n_f32(t_max);
+        for (int a = 0; a < 3; a++) {
+            const float32x4_t o = vdupq_n_f32(r.origin[a]);
+            const float32x4_t inv = vdupq_n_f32(r.inv_dir[a]);
+            const float32x4_t t0 = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[r.dir_is_neg[a]][a]), o), inv);
+            const float32x4_t t1 = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[1 - r.dir_is_neg[a]][a]), o), inv);
+            near_t = vmaxq_f32(t0, near_t);
+            far_t = vminq_f32(t1, far_t);
+        }
+        vst1q_f32(t_near, near_t);
+        const uint32x4_t hit = vcleq_f32(near_t, far_t);
+        return (vgetq_lane_u32(hit, 0) & 1) | (vgetq_lane_u32(hit, 1) & 2) | (vgetq_lane_u32(hit, 2) & 4) | (vgetq_lane_u32(hit, 3) & 8);
+    }
+#endif
+    // Scalar fallback
+    int mask = 0;
+    for (int i = 0; i < W; i++) {
+        float near_i = t_min;
+        float far_i = t_max;
+        for (int a = 0; a < 3; a++) {
+            const float t0 = (node.bounds[r.dir_is_neg[a]][a][i] - r.origin[a]) * r.inv_dir[a];
+            const float t1 = (node.bounds[1 - r.dir_is_neg[a]][a][i] - r.origin[a]) * r.inv_dir[a];
+            near_i = t0 > near_i ? t0 : near_i;
+            far_i = t1 < far_i ? t1 : far_i;
+        }
+        t_near[i] = near_i;
+        mask |= (near_i <= far_i) << i;
+    }
+    return mask;
+}
@@ -0,0 +1,115 @@
+// Compares the random number generators of random_engine.h. First the raw throughput of every engine (single numbers,
+// fill() and the per pixel sample pattern of reseeding and drawing a few numbers), then a render of the random scene and
+// the Cornell box with the engine that is compiled in as RANDOM. CMake builds one rng_benchmark_<engine> per generator
+// (-DRNG_PCG32_FAST, -DRNG_XOSHIRO), run all of them to compare the renders. Pixels stop early once their error is
+// low enough, so below ~48 samples per pixel the render times mostly measure that cutoff.
+//
+// usage: rng_benchmark [samples per pixel]
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <vector>
+
+#include "rtweekend.h"
+#include "random_engine.h"
+#include "raytracer.h"
+#include "scene_generation.h"
+#include "bvh.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+template<class Engine>
+void benchmark_engine() {
+    constexpr size_t count = 1 << 12;
+    constexpr int rounds = 1 << 13;
+    std::vector<double> buffer(count);
+    double checksum = 0; // keeps the compiler from dropping the loops
+
+    Engine engine;
+    engine.seed(1, 2);
+    auto start = bench_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (double& x : buffer)
+            x = engine.next_double();
+        checksum += buffer[r % count];
+    }
+    const double scalar_ns = seconds_since(start) * 1e9 / (double(count) * rounds);
+
+    start = bench_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        engine.fill(buffer);
+        checksum += buffer[r % count];
+    }
+    const double fill_ns = seconds_since(start) * 1e9 / (double(count) * rounds);
+
+    // What a pixel sample does: restart the generator and draw a handful of numbers
+    constexpr int draws_per_sample = 16;
+    const int samples = int(count) * rounds / draws_per_sample;
+    start = bench_clock::now();
+    for (int s = 0; s < samples; s++) {
+        engine.seed(mix_bits(s & 255), s >> 8);
+        engine.fill(std::span<double>(buffer.data(), draws_per_sample));
+        for (int d = 0; d < draws_per_sample; d++)
+            checksum += buffer[d];
+    }
+    const double sample_ns = seconds_since(start) * 1e9 / samples;
+
+    std::cout << std::left << std::setw(16) << Engine::name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << scalar_ns << " ns" << std::setw(10) << fill_ns << " ns"
+              << std::setw(12) << sample_ns << " ns" << "   (" << checksum << ")\n";
+}
+
+void benchmark_render(const std::string& name, const scene_description& description, int samples) {
+    hittable_list scene = description.build();
+    light_list lights(scene);
+    auto world = bvh_node(scene);
+    camera cam(description.camset, 320);
+
+    threaded_renderer renderer(cam.image_width, cam.image_height, 32, samples, 16);
+    renderer.progressive = false;
+    const auto start = bench_clock::now();
+    renderer.render(world, cam, &lights);
+    while (!renderer.finished())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    const double seconds = seconds_since(start);
+
+    color mean(0, 0, 0);
+    for (const auto& c : renderer.pixels)
+        mean += c;
+    mean /= real(renderer.pixels.size());
+    std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(9) << seconds << " s" << std::setw(10) << std::setprecision(2)
+              << renderer.rays_traced / seconds * 1e-6 << " Mrays/s   mean " << std::setprecision(4)
+              << mean.x << " " << mean.y << " " << mean.z << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    int samples = 64;
+    if (argc > 1) {
+        try {
+            samples = std::stoi(argv[1]);
+        }
+        catch (const std::exception&) {
+            samples = 0;
+        }
+        if (samples <= 0) {
+            std::cerr << "Invalid number of samples " << argv[1] << "\nusage: rng_benchmark [samples per pixel]\n";
+            return 1;
+        }
+    }
+
+    std::cout << "Generator        per number  with fill()  per pixel sample\n";
+    benchmark_engine<pcg32_engine>();
+    benchmark_engine<pcg32_fast_engine>();
+    benchmark_engine<xoshiro_engine>();
+
+    std::cout << "\nRendering with " << sample_engine::name << " as RANDOM, " << samples << " samples per pixel\n";
+    benchmark_render("random scene", *find_scene("random"), samples);
+    benchmark_render("cornell box", *find_scene("cornell"), samples);
+    return 0;
+}
@@ -0,0 +1,247 @@
+// Renders the built-in scenes (builtin_scenes() in scene_generation.h) headless and reports their throughput as JSON on
+// stdout, to compare BVH, sampler and threading changes across commits. Every scene is built from the same seed and
+// rendered at a fixed resolution and sample count, once per thread count (1, 2, 4, ... up to the hardware threads).
+// Per scene: BVH build time, primary (camera) and total rays/s, the distribution of samples per pixel (pixels stop
+// early once converged) and the peak resident memory. Progress goes to stderr.
+//
+// usage: scene_benchmark [--width <pixels>] [--spp <samples>] [--depth <bounces>] [--max-threads <count>]
+//                        [--scenes <name,name,...>] [--label <text>]
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#ifdef __linux__
+#include <fstream>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+#include "rtweekend.h"
+#include "raytracer.h"
+#include "scene_generation.h"
+#include "bvh.h"
+
+#ifndef BENCHMARK_COMMIT
+#define BENCHMARK_COMMIT "unknown"
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Peak resident set size of the process in bytes, 0 where it isn't available
+static std::size_t peak_rss() {
+#ifdef __linux__
+    // VmHWM, unlike getrusage(), is reset by reset_peak_rss()
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.starts_with("VmHWM:"))
+            return std::stoull(line.substr(6)) * 1024;
+    return 0;
+#elif defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize;
+#else
+    return 0;
+#endif
+}
+
+// Starts the peak of peak_rss() over from the current memory use, so that it covers a single scene. Only Linux can do
+// that, elsewhere the peak includes the scenes before.
+static void reset_peak_rss() {
+#ifdef __linux__
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+struct benchmark_options {
+    int width = 320;
+    int samples = 32;
+    int max_depth = 32;
+    int max_threads = default_thread_count();
+    std::vector<std::string> scenes;
+    std::string label;
+};
+
+struct thread_run {
+    int threads;
+    double seconds;
+    std::size_t rays, samples;
+};
+
+static std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (const char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+bool parse_options(int argc, char* argv[], benchmark_options& options) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+        const std::string value = argv[i + 1];
+        try {
+            if (arg == "--width")
+                options.width = std::stoi(value);
+            else if (arg == "--spp")
+                options.samples = std::stoi(value);
+            else if (arg == "--depth")
+                options.max_depth = std::stoi(value);
+            else if (arg == "--max-threads")
+                options.max_threads = std::max(1, std::stoi(value));
+            else if (arg == "--label")
+                options.label = value;
+            else if (arg == "--scenes") {
+                std::stringstream names(value);
+                std::string name;
+                while (std::getline(names, name, ','))
+                    options.scenes.push_back(name);
+            }
+            else {
+                std::cerr << "Unknown option " << arg << "\n";
+                return false;
+            }
+        }
+        catch (const std::exception&) {
+            std::cerr << "Invalid value " << value << " for " << arg << "\n";
+            return false;
+        }
+    }
+    if (options.width <= 0 || options.samples <= 0 || options.max_depth <= 0) {
+        std::cerr << "The width, samples and depth must be positive\n";
+        return false;
+    }
+    if (argc % 2 == 0) {
+        std::cerr << "Missing value for " << argv[argc - 1] << "\n";
+        return false;
+    }
+    if (options.scenes.empty())
+        for (const auto& scene : builtin_scenes())
+            options.scenes.push_back(scene.name);
+    for (const auto& name : options.scenes) {
+        if (!find_scene(name)) {
+            std::cerr << "Unknown scene " << name << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Renders one frame like the headless mode of RaytracingWeekend.cpp does
+static thread_run render_frame(threaded_renderer& renderer, const hittable& world, const camera& cam, const light_list& lights) {
+    const auto start = bench_clock::now();
+    renderer.render(world, cam, &lights);
+    while (!renderer.finished())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return { renderer.num_threads, seconds_since(start), renderer.rays_traced, renderer.samples_traced };
+}
+
+static void benchmark_scene(const scene_description& description, const benchmark_options& options, std::ostream& json) {
+    std::cerr << "== " << description.name << "\n";
+    reset_peak_rss();
+
+    // Scenes with random placement come out the same in every run
+    RANDOM.seed(0x5eed, 0);
+    auto start = bench_clock::now();
+    hittable_list scene = description.build();
+    light_list lights(scene);
+    const double scene_seconds = seconds_since(start);
+
+    start = bench_clock::now();
+    auto world = bvh_node(scene, bvh_split_method::binned_sah, default_thread_count());
+    const double bvh_seconds = seconds_since(start);
+    world.build_stats().print(std::cerr);
+
+    camera cam(description.camset, options.width);
+    std::vector<thread_run> runs;
+    std::vector<int> samples_per_pixel;
+    for (int threads = 1;; threads = std::min(threads * 2, options.max_threads)) {
+        threaded_renderer renderer(cam.image_width, cam.image_height, 32, options.samples, options.max_depth, false, threads);
+        runs.push_back(render_frame(renderer, world, cam, lights));
+        std::cerr << threads << " threads: " << runs.back().seconds << " s, "
+                  << runs.back().rays / runs.back().seconds * 1e-6 << " Mrays/s\n";
+        if (threads == options.max_threads) {
+            samples_per_pixel = renderer.pixels_samples;
+            break;
+        }
+    }
+
+    // All thread counts render the same samples, the distribution is taken from the last run
+    std::sort(samples_per_pixel.begin(), samples_per_pixel.end());
+    const auto percentile = [&](double p) {
+        return samples_per_pixel[std::min(samples_per_pixel.size() - 1, static_cast<std::size_t>(p * samples_per_pixel.size()))];
+    };
+    double mean_samples = 0;
+    for (const int s : samples_per_pixel)
+        mean_samples += s;
+    mean_samples /= samples_per_pixel.size();
+
+    const thread_run& fastest = *std::min_element(runs.begin(), runs.end(), [](const auto& a, const auto& b) { return a.seconds < b.seconds; });
+    json << "    {\n"
+         << "      \"name\": " << json_string(description.name) << ",\n"
+         << "      \"scene_build_seconds\": " << scene_seconds << ",\n"
+         << "      \"bvh_build_seconds\": " << bvh_seconds << ",\n"
+         << "      \"peak_rss_bytes\": " << peak_rss() << ",\n"
+         << "      \"primary_rays_per_second\": " << fastest.samples / fastest.seconds << ",\n"
+         << "      \"rays_per_second\": " << fastest.rays / fastest.seconds << ",\n"
+         << "      \"samples_per_pixel\": { \"min\": " << samples_per_pixel.front() << ", \"p10\": " << percentile(0.1)
+         << ", \"median\": " << percentile(0.5) << ", \"p90\": " << percentile(0.9) << ", \"max\": " << samples_per_pixel.back()
+         << ", \"mean\": " << mean_samples << " },\n"
+         << "      \"threads\": [\n";
+    for (std::size_t i = 0; i < runs.size(); i++) {
+        const thread_run& run = runs[i];
+        json << "        { \"threads\": " << run.threads << ", \"seconds\": " << run.seconds
+             << ", \"rays\": " << run.rays << ", \"primary_rays\": " << run.samples
+             << ", \"rays_per_second\": " << run.rays / run.seconds
+             << ", \"speedup\": " << runs.front().seconds / run.seconds << " }" << (i + 1 < runs.size() ? ",\n" : "\n");
+    }
+    json << "      ]\n"
+         << "    }";
+}
+
+int main(int argc, char* argv[]) {
+    benchmark_options options;
+    if (!parse_options(argc, argv, options))
+        return 1;
+
+    std::ostringstream json;
+    json << std::setprecision(6);
+    json << "{\n"
+         << "  \"label\": " << json_string(options.label) << ",\n"
+         << "  \"commit\": " << json_string(BENCHMARK_COMMIT) << ",\n"
+#ifdef SINGLE_PRECISION
+         << "  \"precision\": \"single\",\n"
+#else
+         << "  \"precision\": \"double\",\n"
+#endif
+#ifdef DISPERSION
+         << "  \"dispersion\": true,\n"
+#else
+         << "  \"dispersion\": false,\n"
+#endif
+         << "  \"rng\": " << json_string(sample_engine::name) << ",\n"
+         << "  \"width\": " << options.width << ",\n"
+         << "  \"samples\": " << options.samples << ",\n"
+         << "  \"max_depth\": " << options.max_depth << ",\n"
+         << "  \"scenes\": [\n";
+    for (std::size_t i = 0; i < options.scenes.size(); i++) {
+        benchmark_scene(*find_scene(options.scenes[i]), options, json);
+        json << (i + 1 < options.scenes.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n"
+         << "}\n";
+    std::cout << json.str();
+    return 0;
+}